@@ -49,7 +49,7 @@ void *successor_thread (void *stream) {
     while (1){
         value = (int*)malloc(sizeof(int));
         *value = count;
-        printf("Successor put %d into index %d\n", count, self->put_idx);
+        printf("Successor put %d into index %d\n", count, self->lanes[LANE_NORMAL].put_idx);
         put(self, (void*)value);
         count++;
 
@@ -58,9 +58,14 @@ void *successor_thread (void *stream) {
          */
         if (count > 4) {
             memset(text, 0, 100);
+
+            /* the consumers are reading the buffer at the same time */
+            slock(&self->lock);
             for (i=0; i<BUFFER_SIZE; i++) {
-                sprintf(text, "%s %d ", text, *(int*)self->buffer[i]);
+                sprintf(text, "%s %d ", text, *(int*)self->lanes[LANE_NORMAL].buffer[i]);
             }
+            sunlock(&self->lock);
+
             gtk_entry_set_text(GTK_ENTRY(output_suc), text);
         }
     }
@@ -0,0 +1,216 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "metrics.h"
+
+typedef struct metrics_entry_t metrics_entry_t;
+
+/* linked list of every stream that shows up in the snapshots */
+struct metrics_entry_t {
+    stream_t *stream;
+    const char *name;
+    metrics_entry_t *next;
+};
+
+pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+metrics_entry_t *registry = NULL;
+
+/*
+ * Add a stream to the snapshots under 'name'. Streams have to be
+ * unregistered before they go away since the exporter keeps reading
+ * them from its own thread.
+ */
+void metrics_register(stream_t *stream, const char *name)
+{
+    metrics_entry_t *e = (metrics_entry_t*)malloc(sizeof(metrics_entry_t));
+    e->stream = stream;
+    e->name = name;
+
+    pthread_mutex_lock(&registry_lock);
+    e->next = registry;
+    registry = e;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+void metrics_unregister(stream_t *stream)
+{
+    metrics_entry_t **e;
+    metrics_entry_t *dead;
+
+    pthread_mutex_lock(&registry_lock);
+    for (e = &registry; *e != NULL; e = &(*e)->next) {
+        if ((*e)->stream == stream) {
+            dead = *e;
+            *e = dead->next;
+            free(dead);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+/* registered name of 'stream' or NULL if it isn't registered */
+static const char *metrics_name(stream_t *stream)
+{
+    metrics_entry_t *e;
+    for (e = registry; e != NULL; e = e->next)
+        if (e->stream == stream)
+            return e->name;
+    return NULL;
+}
+
+/* print one counter for every registered stream */
+static void metrics_counter(FILE *f, const char *metric, const char *help,
+                            size_t offset, double scale)
+{
+    metrics_entry_t *e;
+    unsigned long *counter;
+
+    fprintf(f, "# HELP %s %s\n", metric, help);
+    fprintf(f, "# TYPE %s counter\n", metric);
+
+    for (e = registry; e != NULL; e = e->next) {
+        counter = (unsigned long*)((char*)&e->stream->metrics + offset);
+        if (scale == 1)
+            fprintf(f, "%s{stream=\"%s\",id=\"%d\"} %lu\n",
+                    metric, e->name, e->stream->id, metric_read(*counter));
+        else
+            fprintf(f, "%s{stream=\"%s\",id=\"%d\"} %.9f\n",
+                    metric, e->name, e->stream->id, metric_read(*counter) * scale);
+    }
+}
+
+/*
+ * Write the counters of every registered stream to 'f' in the Prometheus
+ * text exposition format. Only the depth gauge has to take a lock, the
+ * consumers own lock, to safely walk its list of producers.
+ */
+void metrics_snapshot(FILE *f)
+{
+    metrics_entry_t *e;
+    producer_t *p;
+    const char *name;
+    char id[16];
+
+    pthread_mutex_lock(&registry_lock);
+
+    metrics_counter(f, "stream_puts_total", "Tokens put into the stream.",
+            offsetof(stream_metrics_t, puts), 1);
+    metrics_counter(f, "stream_gets_total", "Tokens gotten out of the stream by all of its consumers.",
+            offsetof(stream_metrics_t, gets), 1);
+    metrics_counter(f, "stream_put_stall_seconds_total", "Time the producer spent waiting for an empty spot.",
+            offsetof(stream_metrics_t, put_stall_ns), 1e-9);
+    metrics_counter(f, "stream_get_stall_seconds_total", "Time consumers spent waiting for a new token.",
+            offsetof(stream_metrics_t, get_stall_ns), 1e-9);
+
+    fprintf(f, "# HELP stream_consumer_depth Tokens put by a producer that a consumer has not gotten yet.\n");
+    fprintf(f, "# TYPE stream_consumer_depth gauge\n");
+
+    for (e = registry; e != NULL; e = e->next) {
+        slock(&e->stream->lock);
+        for (p = e->stream->prod_head; p != NULL; p = p->next) {
+            name = metrics_name(p->stream);
+            if (name == NULL) {
+                snprintf(id, sizeof(id), "%d", p->stream->id);
+                name = id;
+            }
+            fprintf(f, "stream_consumer_depth{stream=\"%s\",producer=\"%s\"} %lu\n",
+                    e->name, name, stream_pending(p));
+        }
+        sunlock(&e->stream->lock);
+    }
+
+    pthread_mutex_unlock(&registry_lock);
+}
+
+/* rewrite the snapshot file, going through a rename so readers never see half of it */
+static void metrics_write_file(const char *path)
+{
+    char tmp[256];
+    FILE *f;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    f = fopen(tmp, "w");
+    if (f == NULL) return;
+    metrics_snapshot(f);
+    fclose(f);
+
+    rename(tmp, path);
+}
+
+/* answer every connection on a unix socket with a fresh snapshot */
+static void metrics_serve(metrics_exporter_t *self, const char *path)
+{
+    struct sockaddr_un addr;
+    struct pollfd pfd;
+    int fd, client;
+    FILE *f;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+        close(fd);
+        return;
+    }
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    while (self->running) {
+
+        /* wake up every so often to check if we should stop */
+        if (poll(&pfd, 1, self->interval_ms) <= 0) continue;
+
+        client = accept(fd, NULL, NULL);
+        if (client < 0) continue;
+
+        f = fdopen(client, "w");
+        if (f == NULL) {
+            close(client);
+            continue;
+        }
+        metrics_snapshot(f);
+        fclose(f);
+    }
+
+    close(fd);
+    unlink(path);
+}
+
+/*
+ * Exporter thread. Either rewrites (metrics_exporter_t*)->path every
+ * interval_ms or, if the path starts with "unix:", serves snapshots on
+ * that socket until 'running' is cleared.
+ */
+void *metrics_exporter(void *exporter)
+{
+    metrics_exporter_t *self = (metrics_exporter_t *)exporter;
+
+    if (strncmp(self->path, "unix:", 5) == 0) {
+        metrics_serve(self, self->path + 5);
+        pthread_exit(NULL);
+    }
+
+    while (self->running) {
+        metrics_write_file(self->path);
+        usleep(self->interval_ms * 1000);
+    }
+
+    /* one last time so the file reflects the final counts */
+    metrics_write_file(self->path);
+
+    pthread_exit(NULL);
+}
@@ -0,0 +1,26 @@
+#include <stdio.h>
+#include "streams.h"
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+/*
+   Publishes the counters of registered streams in the Prometheus text
+   exposition format. The counters themselves live in each stream_t (see
+   stream_metrics_t) so this only ever reads them.
+*/
+
+typedef struct metrics_exporter_t metrics_exporter_t;
+
+struct metrics_exporter_t {
+    const char *path;       /* file to rewrite, or "unix:/some/socket" to serve on */
+    int interval_ms;        /* how often the file is rewritten */
+    volatile int running;   /* clear to stop the exporter thread */
+};
+
+void metrics_register(stream_t *stream, const char *name);
+void metrics_unregister(stream_t *stream);
+void metrics_snapshot(FILE *f);
+void *metrics_exporter(void *exporter);
+
+#endif
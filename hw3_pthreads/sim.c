@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <ucontext.h>
+#include "sim.h"
+
+/* A thread can only be in one of 4 states */
+enum sim_state {SIM_UNUSED, SIM_RUNNABLE, SIM_BLOCKED, SIM_FINISHED};
+
+typedef struct sim_thread_t sim_thread_t;
+
+struct sim_thread_t {
+    ucontext_t ctx;             /* saved registers and stack */
+    enum sim_state state;       /* what the thread is doing */
+    void *blocked_on;           /* the mutex, cond or sem we are waiting for */
+    void *(*fn)(void *);        /* thread function */
+    void *arg;                  /* argument to the thread function */
+    int daemon;                 /* don't wait for this thread to finish */
+};
+
+static sim_thread_t threads[SIM_MAX_THREADS];
+static char stacks[SIM_MAX_THREADS][SIM_STACK_SIZE];
+
+static ucontext_t scheduler;    /* where sim_run() sits while threads run */
+static int current = -1;        /* running thread, -1 outside of sim_run() */
+static int num_threads = 0;
+static unsigned long rng;       /* xorshift state */
+static long steps = 0;          /* scheduling decisions made so far */
+static long max_steps = 0;      /* give up after this many decisions */
+
+/*
+ * Reset the scheduler for a new run. Every decision the scheduler makes
+ * comes from 'seed' so the same seed gives the same interleaving.
+ */
+void sim_init(unsigned long seed, long limit)
+{
+    int i;
+
+    for (i = 0; i < SIM_MAX_THREADS; i++)
+        threads[i].state = SIM_UNUSED;
+
+    /* xorshift gets stuck at 0 */
+    rng = seed * 0x9E3779B97F4A7C15UL + 1;
+    current = -1;
+    num_threads = 0;
+    steps = 0;
+    max_steps = limit;
+}
+
+unsigned long sim_random(void)
+{
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * 2685821657736338717UL;
+}
+
+long sim_steps(void)
+{
+    return steps;
+}
+
+/* entry point of every simulated thread */
+static void sim_trampoline(void)
+{
+    sim_thread_t *t = &threads[current];
+    t->fn(t->arg);
+    t->state = SIM_FINISHED;
+    /* falls back into the scheduler through uc_link */
+}
+
+/*
+ * Add a thread to the simulation. Daemon threads (ex. a successor that
+ * never stops putting) don't have to finish for the run to be done.
+ */
+int sim_spawn(void *(*fn)(void *), void *arg, int daemon)
+{
+    sim_thread_t *t;
+
+    if (num_threads == SIM_MAX_THREADS) return -1;
+
+    t = &threads[num_threads];
+    t->fn = fn;
+    t->arg = arg;
+    t->daemon = daemon;
+    t->blocked_on = NULL;
+    t->state = SIM_RUNNABLE;
+
+    getcontext(&t->ctx);
+    t->ctx.uc_stack.ss_sp = stacks[num_threads];
+    t->ctx.uc_stack.ss_size = SIM_STACK_SIZE;
+    t->ctx.uc_link = &scheduler;
+    makecontext(&t->ctx, sim_trampoline, 0);
+
+    return num_threads++;
+}
+
+/* true once every non daemon thread has finished */
+static int sim_finished(void)
+{
+    int i;
+    for (i = 0; i < num_threads; i++)
+        if (!threads[i].daemon && threads[i].state != SIM_FINISHED)
+            return 0;
+    return 1;
+}
+
+/* randomly pick one of the runnable threads, -1 if there are none */
+static int sim_pick(void)
+{
+    int runnable[SIM_MAX_THREADS];
+    int n = 0;
+    int i;
+
+    for (i = 0; i < num_threads; i++)
+        if (threads[i].state == SIM_RUNNABLE)
+            runnable[n++] = i;
+
+    if (n == 0) return -1;
+    return runnable[sim_random() % n];
+}
+
+/*
+ * Scheduling point. Hand the cpu to a randomly picked runnable thread,
+ * possibly ourselves. Goes back to the scheduler when nothing can run,
+ * when all the real work is done or when we ran out of steps.
+ */
+static void sim_switch(void)
+{
+    int prev = current;
+    int next;
+
+    steps++;
+
+    next = sim_pick();
+    if (next < 0 || sim_finished() || steps > max_steps) {
+        swapcontext(&threads[prev].ctx, &scheduler);
+        return;
+    }
+
+    if (next == prev) return;
+
+    current = next;
+    swapcontext(&threads[prev].ctx, &threads[next].ctx);
+}
+
+/* block the current thread on 'obj' until someone wakes it up */
+static void sim_block(void *obj)
+{
+    assert(current >= 0);
+    threads[current].state = SIM_BLOCKED;
+    threads[current].blocked_on = obj;
+    sim_switch();
+}
+
+/* wake one (or all) of the threads blocked on 'obj' */
+static void sim_wake(void *obj, int all)
+{
+    int waiting[SIM_MAX_THREADS];
+    int n = 0;
+    int i;
+
+    for (i = 0; i < num_threads; i++)
+        if (threads[i].state == SIM_BLOCKED && threads[i].blocked_on == obj)
+            waiting[n++] = i;
+
+    if (n == 0) return;
+
+    if (!all) {
+        i = waiting[sim_random() % n];
+        threads[i].state = SIM_RUNNABLE;
+        return;
+    }
+
+    for (i = 0; i < n; i++)
+        threads[waiting[i]].state = SIM_RUNNABLE;
+}
+
+/*
+ * Run spawned threads until every non daemon thread finished, nothing is
+ * runnable anymore (deadlock) or the step limit was hit.
+ */
+enum sim_result sim_run(void)
+{
+    int next;
+
+    while (!sim_finished() && steps <= max_steps) {
+        next = sim_pick();
+        if (next < 0) break;
+        current = next;
+        swapcontext(&scheduler, &threads[next].ctx);
+        current = -1;
+    }
+
+    if (sim_finished()) return SIM_DONE;
+    if (steps > max_steps) return SIM_TIMEOUT;
+    return SIM_DEADLOCK;
+}
+
+void sim_yield(void)
+{
+    if (current >= 0) sim_switch();
+}
+
+void sim_mutex_init(sim_mutex_t *m)
+{
+    m->locked = 0;
+}
+
+void sim_mutex_lock(sim_mutex_t *m)
+{
+    sim_yield();
+    while (m->locked)
+        sim_block(m);
+    m->locked = 1;
+}
+
+void sim_mutex_unlock(sim_mutex_t *m)
+{
+    assert(m->locked);
+    m->locked = 0;
+    sim_wake(m, 1);
+    sim_yield();
+}
+
+void sim_cond_init(sim_cond_t *c)
+{
+    c->signals = 0;
+}
+
+void sim_cond_wait(sim_cond_t *c, sim_mutex_t *m)
+{
+    assert(m->locked);
+    m->locked = 0;
+    sim_wake(m, 1);
+    sim_block(c);
+    sim_mutex_lock(m);
+}
+
+void sim_cond_signal(sim_cond_t *c)
+{
+    c->signals++;
+    sim_wake(c, 0);
+    sim_yield();
+}
+
+void sim_cond_broadcast(sim_cond_t *c)
+{
+    c->signals++;
+    sim_wake(c, 1);
+    sim_yield();
+}
+
+void sim_sem_init(sim_sem_t *s, int value)
+{
+    s->value = value;
+}
+
+void sim_sem_wait(sim_sem_t *s)
+{
+    sim_yield();
+    while (s->value == 0)
+        sim_block(s);
+    s->value--;
+}
+
+/* returns 0 if the semaphore was taken, -1 if it would have blocked */
+int sim_sem_trywait(sim_sem_t *s)
+{
+    sim_yield();
+    if (s->value == 0) return -1;
+    s->value--;
+    return 0;
+}
+
+void sim_sem_post(sim_sem_t *s)
+{
+    s->value++;
+    sim_wake(s, 1);
+    sim_yield();
+}
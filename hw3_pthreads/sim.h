@@ -0,0 +1,56 @@
+#ifndef __SIM_H__
+#define __SIM_H__
+
+/*
+   Deterministic single threaded scheduler used when the streams are built
+   with -DSIMULATION.  Every "thread" is a user context that only gives up
+   the cpu at a lock, unlock, wait, signal or semaphore operation.  At each
+   of those points the scheduler picks the next thread to run from a seeded
+   random number generator so the same seed always replays the exact same
+   interleaving.
+*/
+
+#define SIM_MAX_THREADS 16
+#define SIM_STACK_SIZE  (64*1024)
+
+/* how a simulation run ended */
+enum sim_result {SIM_DONE, SIM_DEADLOCK, SIM_TIMEOUT};
+
+typedef struct sim_mutex_t sim_mutex_t;
+typedef struct sim_cond_t sim_cond_t;
+typedef struct sim_sem_t sim_sem_t;
+
+struct sim_mutex_t {
+    int locked;             /* 1 if some thread holds the mutex */
+};
+
+struct sim_cond_t {
+    int signals;            /* how many times it was signaled, for debugging */
+};
+
+struct sim_sem_t {
+    int value;              /* semaphore count */
+};
+
+void sim_init(unsigned long seed, long max_steps);
+int sim_spawn(void *(*fn)(void *), void *arg, int daemon);
+enum sim_result sim_run(void);
+long sim_steps(void);
+unsigned long sim_random(void);
+void sim_yield(void);
+
+void sim_mutex_init(sim_mutex_t *m);
+void sim_mutex_lock(sim_mutex_t *m);
+void sim_mutex_unlock(sim_mutex_t *m);
+
+void sim_cond_init(sim_cond_t *c);
+void sim_cond_wait(sim_cond_t *c, sim_mutex_t *m);
+void sim_cond_signal(sim_cond_t *c);
+void sim_cond_broadcast(sim_cond_t *c);
+
+void sim_sem_init(sim_sem_t *s, int value);
+void sim_sem_wait(sim_sem_t *s);
+int sim_sem_trywait(sim_sem_t *s);
+void sim_sem_post(sim_sem_t *s);
+
+#endif
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <semaphore.h>
@@ -19,97 +21,277 @@ pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
 
 int idcnt = 1;
 
-void *get(producer_t *producer)
+/* monotonic time in nanoseconds, used to measure how long put/get stall */
+unsigned long stream_now_ns(void)
 {
-    //struct timeval tv;
-    void *ret;  /* needed to take save a value from the critical section */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
 
-    int *buffer_idx          = &producer->buffer_idx;
-    pthread_mutex_t *lock    = &producer->stream->lock;
-    pthread_cond_t *notifier = &producer->stream->notifier;
-    sem_t *empty             = &producer->stream->empty;
+#ifndef SIMULATION
+/* cleanup handler for swait() */
+void stream_cancel_unlock(void *lock)
+{
+    pthread_mutex_unlock((pthread_mutex_t*)lock);
+}
+#endif
 
-    /* make sure no other getters come in here */
-    pthread_mutex_lock(lock);
+/*
+ * Lane the next token for 'producer' comes from, -1 if there is nothing
+ * new in any of them. That is the highest priority lane with something in
+ * it, unless we already took STARVE_LIMIT tokens in a row while a lower
+ * lane was waiting, then the lowest waiting lane gets its turn.
+ * Called with the producers lock held.
+ */
+static int next_lane(producer_t *producer)
+{
+    stream_t *stream = producer->stream;
+    int l, first = -1, last = -1;
 
-    /* if we are ahead where the producer is writing, wait */
-    while ((*buffer_idx+1)%BUFFER_SIZE == (producer->stream->put_idx)%BUFFER_SIZE) {
-        //tprintf("\tGetter caught up to putter, waiting at buff idx %d\n", *buffer_idx);
-        pthread_cond_wait(notifier, lock);
+    for (l = 0; l < NUM_LANES; l++) {
+        if (producer->seq[l] != stream->lanes[l].put_seq) {
+            if (first < 0) first = l;
+            last = l;
+        }
     }
 
-    /* if there isn't anything new here, wait */
-    while (producer->stream->buffer_read_count[*buffer_idx] >= producer->stream->num_consumers) {
-        //tprintf("\tGetter found nothing new at idx %d, waiting\n", *buffer_idx)
-        pthread_cond_wait(notifier, lock);
+    /* nothing or only one lane waiting, nobody is being starved */
+    if (first == last) {
+        producer->starved = 0;
+        return first;
     }
 
-/*
-    tprintf("\t\tGetting from buf idx %d (read count: %d) current put idx %d\n",
-            *buffer_idx,
-            producer->stream->buffer_read_count[*buffer_idx],
-            producer->stream->put_idx);
-*/
+    if (producer->starved >= STARVE_LIMIT) {
+        producer->starved = 0;
+        return last;
+    }
+
+    producer->starved++;
+    return first;
+}
+
+/* get the next token out of lane 'l', called with the producers lock held */
+static void *take(producer_t *producer, int l)
+{
+    stream_t *stream = producer->stream;
+    lane_t *lane     = &stream->lanes[l];
+    int *buffer_idx  = &producer->buffer_idx[l];
+    void *ret;
 
     /* get the value out of the producer streams buffer */
-    ret = producer->stream->buffer[*buffer_idx];
+    ret = lane->buffer[*buffer_idx];
 
     /* decrease the read count since we just got a value */
-    producer->stream->buffer_read_count[*buffer_idx]++;
+    lane->buffer_read_count[*buffer_idx]++;
 
     /* if we are last getter, the spot is now empty */
-    if(producer->stream->buffer_read_count[*buffer_idx] == producer->stream->num_consumers)
-        sem_post(empty);
+    if (lane->buffer_read_count[*buffer_idx] == stream->num_consumers)
+        ssem_post(&lane->empty);
 
     /* go to the next buffer location for next time*/
-    *buffer_idx = (*buffer_idx + 1) % BUFFER_SIZE;
+    __atomic_store_n(&producer->seq[l], producer->seq[l] + 1, __ATOMIC_RELAXED);
+    *buffer_idx = producer->seq[l] % BUFFER_SIZE;
+
+    return ret;
+}
+
+void *get(producer_t *producer)
+{
+    //struct timeval tv;
+    void *ret;  /* needed to take save a value from the critical section */
+
+    stream_t *stream         = producer->stream;
+    slock_t *lock            = &stream->lock;
+    scond_t *notifier        = &stream->notifier;
+    unsigned long stall;
+    int l;
+
+    /* make sure no other getters come in here */
+    slock(lock);
+
+    /* if we have already read everything the producer has put, wait */
+    if ((l = next_lane(producer)) < 0) {
+        stall = stream_now_ns();
+        while ((l = next_lane(producer)) < 0) {
+            //tprintf("\tGetter caught up to putter, waiting\n");
+            swait(notifier, lock);
+        }
+        metric_add(stream->metrics.get_stall_ns, stream_now_ns() - stall);
+    }
 
-    /* notify producer that we've moved on */
-    pthread_cond_signal(notifier);
+    ret = take(producer, l);
+    metric_add(stream->metrics.gets, 1);
+
+    /* notify producer that we've moved on, the producer and all of
+     * the getters share one notifier so everyone has to be woken up */
+    sbroadcast(notifier);
 
     /* allow other getters to come in */
-    pthread_mutex_unlock(lock);
+    sunlock(lock);
 
     return ret;
 }
 
+/*
+ * Get up to 'max' tokens at once under a single lock, in the same lane
+ * order get() would have returned them. Waits only until there is at
+ * least one new token and returns how many were gotten.
+ */
+int get_batch(producer_t *producer, void **values, int max)
+{
+    stream_t *stream         = producer->stream;
+    slock_t *lock            = &stream->lock;
+    scond_t *notifier        = &stream->notifier;
+    unsigned long stall;
+    int n, l;
+
+    slock(lock);
+
+    if ((l = next_lane(producer)) < 0) {
+        stall = stream_now_ns();
+        while ((l = next_lane(producer)) < 0)
+            swait(notifier, lock);
+        metric_add(stream->metrics.get_stall_ns, stream_now_ns() - stall);
+    }
+
+    /* take everything that is there, up to what fits */
+    for (n = 0; n < max && l >= 0; n++) {
+        values[n] = take(producer, l);
+        if (n + 1 < max)
+            l = next_lane(producer);
+    }
+
+    metric_add(stream->metrics.gets, n);
+
+    sbroadcast(notifier);
+    sunlock(lock);
+
+    return n;
+}
+
+/* tokens 'producer' put that we haven't gotten yet, over all lanes */
+unsigned long stream_pending(producer_t *producer)
+{
+    unsigned long n = 0;
+    int l;
+
+    for (l = 0; l < NUM_LANES; l++)
+        n += metric_read(producer->stream->lanes[l].put_seq) - metric_read(producer->seq[l]);
+
+    return n;
+}
+
 void put(stream_t *stream, void *value)
 {
-    //struct timeval tv;
-    pthread_mutex_t *lock    = &stream->lock;
-    pthread_cond_t *notifier = &stream->notifier;
-    sem_t *empty             = &stream->empty;
+    put_lane(stream, value, LANE_NORMAL);
+}
 
-    /* wait until there are empty slots in the buffer */
-    sem_wait(empty);
+/*
+ * Put a token into one of the priority lanes. Consumers get anything in
+ * LANE_HIGH before what is already waiting in LANE_NORMAL, so control
+ * tokens (flush, reconfigure..) don't have to queue behind a full buffer.
+ */
+void put_lane(stream_t *stream, void *value, int l)
+{
+    //struct timeval tv;
+    slock_t *lock            = &stream->lock;
+    scond_t *notifier        = &stream->notifier;
+    lane_t *lane             = &stream->lanes[l];
+    unsigned long stall;
+
+    /* wait until there are empty slots in the buffer, only look at
+     * the clock if we actually have to wait */
+    if (ssem_trywait(&lane->empty) != 0) {
+        stall = stream_now_ns();
+        ssem_wait(&lane->empty);
+        metric_add(stream->metrics.put_stall_ns, stream_now_ns() - stall);
+    }
 
-    pthread_mutex_lock(lock);
+    slock(lock);
 
     /* wait if all consumers haven't seen this value */
-    while (stream->buffer_read_count[stream->put_idx] < stream->num_consumers) {
-        //tprintf("Put read count at idx %d is %d, waiting\n", stream->put_idx, stream->buffer_read_count[stream->put_idx]);
-        //tprintf("Num consumers: %d\n", stream->num_consumers);
-        pthread_cond_wait(notifier, lock);
+    if (lane->buffer_read_count[lane->put_idx] < stream->num_consumers) {
+        stall = stream_now_ns();
+        while (lane->buffer_read_count[lane->put_idx] < stream->num_consumers) {
+            //tprintf("Put read count at idx %d is %d, waiting\n", lane->put_idx, lane->buffer_read_count[lane->put_idx]);
+            //tprintf("Num consumers: %d\n", stream->num_consumers);
+            swait(notifier, lock);
+        }
+        metric_add(stream->metrics.put_stall_ns, stream_now_ns() - stall);
     }
 
     /* put the new value in the buffer */
-    stream->buffer[stream->put_idx] = value;
+    lane->buffer[lane->put_idx] = value;
 
     /* reset the read cound since this is a fresh value */
-    stream->buffer_read_count[stream->put_idx] = 0;
-    //tprintf("Putting '%d' at idx %d\n", *(int*)value, stream->put_idx);
+    lane->buffer_read_count[lane->put_idx] = 0;
+    if (stream->num_consumers == 0) lane->unclaimed++;
+    //tprintf("Putting '%d' at idx %d\n", *(int*)value, lane->put_idx);
 
     /* go next buffer position for next time */
-    stream->put_idx = (stream->put_idx + 1) % BUFFER_SIZE;
+    __atomic_store_n(&lane->put_seq, lane->put_seq + 1, __ATOMIC_RELAXED);
+    lane->put_idx = lane->put_seq % BUFFER_SIZE;
+    metric_add(stream->metrics.puts, 1);
 
-    /* notify the consumer that we've updated */
-    pthread_cond_signal(notifier);
+    /* notify the consumers that we've updated */
+    sbroadcast(notifier);
 
-    pthread_mutex_unlock(lock);
+    sunlock(lock);
 
     return;
 }
 
+/*
+ * Put 'n' tokens into LANE_NORMAL handing them to the consumers in as few
+ * lock round trips as possible. Every empty spot that can be had without
+ * waiting is filled under one lock, we only block when the buffer is
+ * completely full.
+ */
+void put_batch(stream_t *stream, void **values, int n)
+{
+    slock_t *lock            = &stream->lock;
+    scond_t *notifier        = &stream->notifier;
+    lane_t *lane             = &stream->lanes[LANE_NORMAL];
+    unsigned long stall;
+    int done = 0;
+    int i, k;
+
+    while (done < n) {
+
+        /* wait for the first empty spot, grab the rest if they are there */
+        if (ssem_trywait(&lane->empty) != 0) {
+            stall = stream_now_ns();
+            ssem_wait(&lane->empty);
+            metric_add(stream->metrics.put_stall_ns, stream_now_ns() - stall);
+        }
+        k = 1;
+        while (done + k < n && ssem_trywait(&lane->empty) == 0)
+            k++;
+
+        slock(lock);
+
+        for (i = 0; i < k; i++) {
+            while (lane->buffer_read_count[lane->put_idx] < stream->num_consumers)
+                swait(notifier, lock);
+
+            lane->buffer[lane->put_idx] = values[done + i];
+            lane->buffer_read_count[lane->put_idx] = 0;
+            if (stream->num_consumers == 0) lane->unclaimed++;
+
+            __atomic_store_n(&lane->put_seq, lane->put_seq + 1, __ATOMIC_RELAXED);
+            lane->put_idx = lane->put_seq % BUFFER_SIZE;
+        }
+
+        metric_add(stream->metrics.puts, k);
+
+        sbroadcast(notifier);
+        sunlock(lock);
+
+        done += k;
+    }
+}
+
 /* Put 1,2,3,4,5... into a stream */
 void *successor (void *stream) {
     struct timeval tv;
@@ -193,6 +375,82 @@ void *merge (void *stream) {
 }
 
 
+/*
+ * Put only the tokens (filter_t*)self->data->pred returns non zero for into
+ * the self stream. Tokens are gotten a batch at a time and the predicate is
+ * run over the whole batch into a selection vector. Survivors are put a full
+ * batch at a time, or as soon as the producer has nothing more waiting, so
+ * dropped tokens never cost a handoff and kept ones share theirs.
+ */
+void *filter (void *stream) {
+    stream_t *self = (stream_t *)stream;
+    filter_t *f = (filter_t *)self->data;
+    producer_t *p;
+    void *in[STAGE_BATCH];
+    void *out[2 * STAGE_BATCH];
+    int sel[STAGE_BATCH];
+    int i, n, k = 0, kept;
+
+    while (true) {
+        p = self->prod_head;
+        while (p != NULL)
+        {
+            n = get_batch(p, in, STAGE_BATCH);
+
+            /* no branch on the predicate, just don't advance on a miss */
+            kept = 0;
+            for (i = 0; i < n; i++) {
+                sel[kept] = i;
+                kept += f->pred(in[i], f->arg) != 0;
+            }
+
+            for (i = 0; i < kept; i++)
+                out[k++] = in[sel[i]];
+
+            /* hand on full batches, or whatever there is once nothing more is waiting */
+            if (k >= STAGE_BATCH || (k > 0 && stream_pending(p) == 0)) {
+                put_batch(self, out, k);
+                k = 0;
+            }
+
+            p = p->next;
+        }
+    }
+    pthread_exit(NULL);
+}
+
+/*
+ * Turn every token into zero or more tokens with (flatmap_t*)self->data->fn
+ * and put everything a batch produced into the self stream in one go.
+ */
+void *flatmap (void *stream) {
+    stream_t *self = (stream_t *)stream;
+    flatmap_t *f = (flatmap_t *)self->data;
+    producer_t *p;
+    void *in[STAGE_BATCH];
+    void *out[STAGE_BATCH * FLATMAP_MAX];
+    int i, n, k;
+
+    while (true) {
+        p = self->prod_head;
+        while (p != NULL)
+        {
+            n = get_batch(p, in, STAGE_BATCH);
+
+            k = 0;
+            for (i = 0; i < n; i++)
+                k += f->fn(in[i], out + k, FLATMAP_MAX, f->arg);
+
+            if (k > 0)
+                put_batch(self, out, k);
+
+            p = p->next;
+        }
+    }
+    pthread_exit(NULL);
+}
+
+
 void *consumer(void *stream)
 {
     struct timeval tv;
@@ -227,16 +485,21 @@ void *consume_single(stream_t *stream) {
 void init_stream(stream_t *stream, void *data) {
     stream->id = idcnt++;
     stream->data = data;
-    pthread_mutex_init(&stream->lock, NULL);
-    pthread_cond_init (&stream->notifier, NULL);
+    slock_init(&stream->lock);
+    scond_init(&stream->notifier);
     stream->prod_head = NULL;
     stream->prod_curr = NULL;
-    stream->put_idx = 0;
     stream->num_consumers = 0;
-    int i;
-    for (i=0; i<BUFFER_SIZE; i++)
-        stream->buffer_read_count[i] = 9999;
-    sem_init(&stream->empty, 0, BUFFER_SIZE);
+    memset(&stream->metrics, 0, sizeof(stream_metrics_t));
+    int i, l;
+    for (l=0; l<NUM_LANES; l++) {
+        stream->lanes[l].put_idx = 0;
+        stream->lanes[l].put_seq = 0;
+        stream->lanes[l].unclaimed = 0;
+        for (i=0; i<BUFFER_SIZE; i++)
+            stream->lanes[l].buffer_read_count[i] = 9999;
+        ssem_init(&stream->lanes[l].empty, BUFFER_SIZE);
+    }
 }
 
 /* free allocated space in the queue - see queue_a.h and queue_a.c */
@@ -246,11 +509,45 @@ void stream_connect (stream_t *in, stream_t *out) {
 
     /* add the producer to the consumers list of producers */
     producer_t *p = (producer_t*)malloc(sizeof(producer_t));
+    lane_t *lane;
+    unsigned long seq, end;
+    int l;
 
-    p->buffer_idx = out->put_idx;
     p->stream = out;
     p->next = NULL;
     p->prev = NULL;
+    p->starved = 0;
+
+    slock(&out->lock);
+
+    /* start at the oldest token still waiting for somebody to read it.
+     * Everything before that has been read by everyone already so count
+     * ourselves as having read it too, otherwise the producer would wait
+     * on us forever. With nobody connected yet that is every token put
+     * since the last one left, their spots only free up once we read them */
+    for (l = 0; l < NUM_LANES; l++) {
+        lane = &out->lanes[l];
+        seq = lane->put_seq < BUFFER_SIZE ? 0 : lane->put_seq - BUFFER_SIZE;
+        end = lane->put_seq - lane->unclaimed;
+        while (seq < end &&
+               lane->buffer_read_count[seq % BUFFER_SIZE] >= out->num_consumers) {
+            lane->buffer_read_count[seq % BUFFER_SIZE]++;
+            seq++;
+        }
+        lane->unclaimed = 0;
+
+        p->seq[l] = seq;
+        p->buffer_idx[l] = seq % BUFFER_SIZE;
+    }
+
+    out->num_consumers++;
+
+    sbroadcast(&out->notifier);
+    sunlock(&out->lock);
+
+    /* the list is guarded by our own lock so it can be walked safely
+     * from other threads (see metrics.c) */
+    slock(&in->lock);
 
     if (in->prod_head == NULL) {
         in->prod_head = p;
@@ -261,34 +558,61 @@ void stream_connect (stream_t *in, stream_t *out) {
         in->prod_curr = p;
     }
 
-    out->num_consumers++;
-    pthread_cond_signal(&out->notifier);
-    pthread_cond_signal(&in->notifier);
+    sunlock(&in->lock);
 }
 
 void stream_disconnect(stream_t *in, stream_t *out) {
 
-    producer_t *p = in->prod_head;
+    producer_t *p;
+    lane_t *lane;
+    unsigned long seq;
+    int i, l, was_empty;
 
-    while (p != NULL)
-    {
-        if (p->stream == out) {
-            if (p->prev != NULL) {
-                p->prev->next = p->next;
-                if (p->next != NULL) {
-                    p->next->prev = p->prev;
-                }
-            }
-            out->num_consumers--;
-            int i;
-            for (i = 0; i < BUFFER_SIZE; i++)
-                if (p->stream->buffer_read_count[i] > 0)
-                    p->stream->buffer_read_count[i]--;
-
-            free(p);
-            break;
-        }
+    slock(&in->lock);
+
+    p = in->prod_head;
+    while (p != NULL && p->stream != out)
         p = p->next;
+
+    /* unlink ourselves from the list */
+    if (p != NULL) {
+        if (p->prev != NULL)
+            p->prev->next = p->next;
+        else
+            in->prod_head = p->next;
+
+        if (p->next != NULL)
+            p->next->prev = p->prev;
+        else
+            in->prod_curr = p->prev;
+    }
+
+    sunlock(&in->lock);
+
+    if (p == NULL) return;
+
+    slock(&out->lock);
+
+    /* take back our reads from the tokens still in the buffer, the
+     * ones we never got to stay as they are. Anything that now has
+     * been read by everyone left is an empty spot. */
+    for (l = 0; l < NUM_LANES; l++) {
+        lane = &out->lanes[l];
+        seq = lane->put_seq < BUFFER_SIZE ? 0 : lane->put_seq - BUFFER_SIZE;
+        for (; seq < lane->put_seq; seq++) {
+            i = seq % BUFFER_SIZE;
+            was_empty = lane->buffer_read_count[i] >= out->num_consumers;
+            if (seq < p->seq[l])
+                lane->buffer_read_count[i]--;
+            if (!was_empty && lane->buffer_read_count[i] >= out->num_consumers - 1)
+                ssem_post(&lane->empty);
+        }
     }
-}
 
+    out->num_consumers--;
+
+    sbroadcast(&out->notifier);
+    sunlock(&out->lock);
+
+    free(p);
+}
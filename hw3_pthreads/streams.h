@@ -1,9 +1,74 @@
+#include <pthread.h>
 #include <semaphore.h>
 
 #ifndef __STREAMS_H__
 #define __STREAMS_H__
 
+#ifndef BUFFER_SIZE
 #define BUFFER_SIZE 5
+#endif
+
+/* how many priority lanes every stream has, lane 0 goes first */
+#ifndef NUM_LANES
+#define NUM_LANES 2
+#endif
+
+#define LANE_HIGH   0
+#define LANE_NORMAL (NUM_LANES - 1)
+
+/* most tokens in a row a consumer gets from higher lanes while a lower
+ * lane has something waiting for it */
+#ifndef STARVE_LIMIT
+#define STARVE_LIMIT 8
+#endif
+
+/* most tokens a filter or flat map stage works on at once */
+#define STAGE_BATCH 64
+
+/* most tokens a flat map function may turn a single token into */
+#define FLATMAP_MAX 8
+
+/*
+ * When compiled with SIMULATION every lock, wait and semaphore goes through
+ * the deterministic scheduler in sim.c instead of pthreads so the streams
+ * can be run single threaded from a seed.
+ */
+#ifdef SIMULATION
+#include "sim.h"
+#define slock_t                 sim_mutex_t
+#define scond_t                 sim_cond_t
+#define ssem_t                  sim_sem_t
+#define slock_init(l)           sim_mutex_init(l)
+#define slock(l)                sim_mutex_lock(l)
+#define sunlock(l)              sim_mutex_unlock(l)
+#define scond_init(c)           sim_cond_init(c)
+#define swait(c, l)             sim_cond_wait(c, l)
+#define sbroadcast(c)           sim_cond_broadcast(c)
+#define ssem_init(s, v)         sim_sem_init(s, v)
+#define ssem_wait(s)            sim_sem_wait(s)
+#define ssem_trywait(s)         sim_sem_trywait(s)
+#define ssem_post(s)            sim_sem_post(s)
+#else
+#define slock_t                 pthread_mutex_t
+#define scond_t                 pthread_cond_t
+#define ssem_t                  sem_t
+#define slock_init(l)           pthread_mutex_init(l, NULL)
+#define slock(l)                pthread_mutex_lock(l)
+#define sunlock(l)              pthread_mutex_unlock(l)
+#define scond_init(c)           pthread_cond_init(c, NULL)
+/* a stage cancelled while waiting wakes up holding the lock, give it back */
+#define swait(c, l)             do { \
+                                    pthread_cleanup_push(stream_cancel_unlock, l); \
+                                    pthread_cond_wait(c, l); \
+                                    pthread_cleanup_pop(0); \
+                                } while (0)
+#define sbroadcast(c)           pthread_cond_broadcast(c)
+#define ssem_init(s, v)         sem_init(s, 0, v)
+#define ssem_wait(s)            sem_wait(s)
+#define ssem_trywait(s)         sem_trywait(s)
+#define ssem_post(s)            sem_post(s)
+void stream_cancel_unlock(void *lock);
+#endif
 
 /*
    One of these per stream.  Holds:  the mutex lock and notifier condition
@@ -12,47 +77,108 @@
 */
 
 typedef struct stream_t stream_t;
+typedef struct lane_t lane_t;
 typedef struct producer_t producer_t;
+typedef struct stream_metrics_t stream_metrics_t;
+typedef struct filter_t filter_t;
+typedef struct flatmap_t flatmap_t;
 
-struct stream_t {
-    int id;                                 /* unique stream id */
-    void *data;                             /* delay / multiplier / etc.. */
-    pthread_mutex_t lock;                   /* mutex lock for buffer and notifier */
-    pthread_cond_t notifier;                /* notifier to sleep and be woken up when even occur */
+/*
+   Counters kept by every stream.  They are only ever bumped with relaxed
+   atomic adds so reading them from another thread (see metrics.c) never
+   needs the stream lock.  Stall times are only measured when a put or get
+   actually has to wait so the fast path is just the two counters.
+*/
+struct stream_metrics_t {
+    unsigned long puts;                     /* tokens put into the stream */
+    unsigned long gets;                     /* tokens gotten out of the stream by all consumers */
+    unsigned long put_stall_ns;             /* time the producer spent waiting for an empty spot */
+    unsigned long get_stall_ns;             /* time consumers spent waiting for a new token */
+};
 
-    sem_t empty;                            /* keeps track of how many empty sports there are in the buffer */
+#define metric_add(m, n)        __atomic_fetch_add(&(m), (n), __ATOMIC_RELAXED)
+#define metric_read(m)          __atomic_load_n(&(m), __ATOMIC_RELAXED)
+
+/*
+   One ring buffer of tokens.  Every stream has NUM_LANES of them, tokens
+   stay in order within a lane but a consumer always gets from the lowest
+   numbered lane that has something for it (see get()).
+*/
+struct lane_t {
+    ssem_t empty;                           /* keeps track of how many empty sports there are in the buffer */
     void *buffer[BUFFER_SIZE];              /* void pointer buffer to store any type of data */
     int buffer_read_count[BUFFER_SIZE];     /* count of how many consumers have read from each index */
 
     int put_idx;                            /* producers index into the buffer */
+    unsigned long put_seq;                  /* how many tokens have ever been put */
+    int unclaimed;                          /* tokens put while nobody was connected, the next consumer gets them */
+};
+
+struct stream_t {
+    int id;                                 /* unique stream id */
+    void *data;                             /* delay / multiplier / etc.. */
+    slock_t lock;                           /* mutex lock for buffer and notifier */
+    scond_t notifier;                       /* notifier to sleep and be woken up when even occur */
+
+    lane_t lanes[NUM_LANES];                /* one buffer per priority, LANE_HIGH first */
     int num_consumers;                      /* how many consumers are connected to this producer */
 
     producer_t *prod_head;                  /* head of the producer linked list */
     producer_t *prod_curr;                  /* used for building the linked list */
+
+    stream_metrics_t metrics;               /* put/get counters and stall times */
 };
 
 /*
    A linked list of all the producers a consumer consumes from.
-   'buffer_idx' is the read index into the producers buffer.
+   'buffer_idx' is the read index into each of the producers lanes and
+   'seq' is the number of the next token we will read from it, so there is
+   something new for us whenever 'seq' is behind the lanes 'put_seq'.
 */
 struct producer_t {
-    int buffer_idx;         /* read idex into the producers buffer */
-    stream_t *stream;       /* the actual producer stream */
-    producer_t *next;       /* the next producer in our list */
-    producer_t *prev;       /* the previous producer in our list */
+    int buffer_idx[NUM_LANES];      /* read idex into each of the producers lanes */
+    unsigned long seq[NUM_LANES];   /* sequence number of the next token to read */
+    int starved;                    /* tokens gotten in a row while a lower lane waited */
+    stream_t *stream;               /* the actual producer stream */
+    producer_t *next;               /* the next producer in our list */
+    producer_t *prev;               /* the previous producer in our list */
+};
+
+/*
+   Passed as the data of a filter stream. Only tokens 'pred' returns
+   non zero for are put into the filter stream.
+*/
+struct filter_t {
+    int (*pred)(void *token, void *arg);
+    void *arg;
 };
 
+/*
+   Passed as the data of a flat map stream. 'fn' writes anywhere from 0
+   up to 'max' tokens into 'out' for every token and returns how many.
+*/
+struct flatmap_t {
+    int (*fn)(void *token, void **out, int max, void *arg);
+    void *arg;
+};
 
 void *get(producer_t *producer);
+int get_batch(producer_t *producer, void **values, int max);
 void put(stream_t *stream, void *value);
+void put_lane(stream_t *stream, void *value, int lane);
+void put_batch(stream_t *stream, void **values, int n);
 void *successor(void *stream);
 void *times(void *stream);
 void *merge(void *stream);
+void *filter(void *stream);
+void *flatmap(void *stream);
 void *consumer(void *streams);
 void *consume_single(stream_t *stream);
 void init_stream(stream_t *stream, void *data);
 void kill_stream(stream_t *stream);
 void stream_connect(stream_t *in, stream_t *out);
 void stream_disconnect(stream_t *in, stream_t *out);
+unsigned long stream_now_ns(void);
+unsigned long stream_pending(producer_t *producer);
 
 #endif
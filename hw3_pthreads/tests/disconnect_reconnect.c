@@ -7,21 +7,22 @@
 void print_buffers(stream_t *stream)
 {
     producer_t *p = stream->prod_head;
+    lane_t *lane = &p->stream->lanes[LANE_NORMAL];
 
     int i;
     printf("VALUE | ");
     for (i = 0; i < BUFFER_SIZE; i++)
-        printf("%02d | ", *(int*)p->stream->buffer[i]);
+        printf("%02d | ", *(int*)lane->buffer[i]);
     printf("\n");
 
     printf("COUNT | ");
     for (i = 0; i < BUFFER_SIZE; i++)
-        printf("%02d | ", p->stream->buffer_read_count[i]);
+        printf("%02d | ", lane->buffer_read_count[i]);
     printf("\n");
 
     printf("P IDX | ");
     for (i = 0; i < BUFFER_SIZE; i++)
-        if (i == p->stream->put_idx)
+        if (i == lane->put_idx)
             printf("^^   ");
         else
             printf("     ");
@@ -29,7 +30,7 @@ void print_buffers(stream_t *stream)
 
     printf("G IDX | ");
     for (i = 0; i < BUFFER_SIZE; i++)
-        if (i == p->buffer_idx)
+        if (i == p->buffer_idx[LANE_NORMAL])
             printf("^^   ");
         else
             printf("     ");
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include "streams.h"
+
+/* keep even numbers */
+int is_even(void *token, void *arg) {
+    return *(int*)token % 2 == 0;
+}
+
+/* x -> x, x*multiplier */
+int and_times(void *token, void **out, int max, void *arg) {
+    int *a = (int*)malloc(sizeof(int));
+    int *b = (int*)malloc(sizeof(int));
+    *a = *(int*)token;
+    *b = *(int*)token * *(int*)arg;
+    out[0] = a;
+    out[1] = b;
+    return 2;
+}
+
+int main(void) {
+    printf("01\t---------------------------------------------------\n");
+    printf("02\t1 successor, 1 filter, 1 flat map, 1 non threaded consumer\n");
+    printf("03\tfilter keeps evens, flat map sends x then x*10\n");
+    printf("04\t---------------------------------------------------\n");
+
+    int delay = 0;
+    int multiplier = 10;
+    int i, x;
+
+    filter_t evens = {is_even, NULL};
+    flatmap_t expand = {and_times, &multiplier};
+
+    pthread_t s1;
+    pthread_t f1;
+    pthread_t m1;
+
+    stream_t suc1;
+    stream_t filt1;
+    stream_t map1;
+    stream_t cons1;
+
+    init_stream(&suc1, &delay);
+    init_stream(&filt1, &evens);
+    init_stream(&map1, &expand);
+    init_stream(&cons1, NULL);
+
+    stream_connect(&filt1, &suc1);
+    stream_connect(&map1, &filt1);
+    stream_connect(&cons1, &map1);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+    pthread_create(&s1, &attr, successor, (void*)&suc1);
+    pthread_create(&f1, &attr, filter, (void*)&filt1);
+    pthread_create(&m1, &attr, flatmap, (void*)&map1);
+
+    for (i = 1; i <= 10; i++) {
+        x = *(int*)consume_single(&cons1);
+        printf("Consumer 1 got: %d\n", x);
+        assert(x == 2*i);
+        x = *(int*)consume_single(&cons1);
+        printf("Consumer 1 got: %d\n", x);
+        assert(x == 2*i*multiplier);
+    }
+
+    pthread_cancel(m1);
+    pthread_cancel(f1);
+    pthread_cancel(s1);
+
+    kill_stream(&suc1);
+
+    printf("done\n");
+
+    return 0;
+}
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "streams.h"
+
+/*
+   Throughput of a filter stage at different selectivities, the batched
+   filter() from streams.c against a naive one that does a get() and put()
+   for every single token. Built by 'make bench' with a bigger buffer.
+*/
+
+#define TOKENS  2000000
+
+int keys[TOKENS];
+int sentinel = -1;
+
+/* keep keys below the threshold, and always the sentinel */
+int below(void *token, void *arg) {
+    int key = *(int*)token;
+    return key < *(int*)arg || key < 0;
+}
+
+/* put every key and then the sentinel */
+void *source(void *stream) {
+    stream_t *self = (stream_t*)stream;
+    void *batch[STAGE_BATCH];
+    int i, n = 0;
+
+    for (i = 0; i < TOKENS; i++) {
+        batch[n++] = &keys[i];
+        if (n == STAGE_BATCH) {
+            put_batch(self, batch, n);
+            n = 0;
+        }
+    }
+    batch[n++] = &sentinel;
+    put_batch(self, batch, n);
+
+    pthread_exit(NULL);
+}
+
+/* get until the sentinel shows up */
+void *sink(void *stream) {
+    stream_t *self = (stream_t*)stream;
+    void *batch[STAGE_BATCH];
+    int i, n;
+
+    while (1) {
+        n = get_batch(self->prod_head, batch, STAGE_BATCH);
+        for (i = 0; i < n; i++)
+            if (batch[i] == &sentinel)
+                pthread_exit(NULL);
+    }
+}
+
+/* filter the way you would without batching */
+void *naive_filter(void *stream) {
+    stream_t *self = (stream_t *)stream;
+    filter_t *f = (filter_t *)self->data;
+    void *token;
+
+    while (1) {
+        token = get(self->prod_head);
+        if (f->pred(token, f->arg))
+            put(self, token);
+    }
+}
+
+/* returns millions of input tokens per second */
+double run(void *(*stage)(void *), int threshold) {
+    struct timespec start, end;
+    pthread_t t_src, t_filt, t_sink;
+    stream_t s_src, s_filt, s_sink;
+    filter_t f = {below, &threshold};
+
+    init_stream(&s_src, NULL);
+    init_stream(&s_filt, &f);
+    init_stream(&s_sink, NULL);
+
+    stream_connect(&s_filt, &s_src);
+    stream_connect(&s_sink, &s_filt);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_create(&t_sink, NULL, sink, &s_sink);
+    pthread_create(&t_filt, NULL, stage, &s_filt);
+    pthread_create(&t_src, NULL, source, &s_src);
+
+    pthread_join(t_src, NULL);
+    pthread_join(t_sink, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    pthread_cancel(t_filt);
+    pthread_join(t_filt, NULL);
+
+    return TOKENS / ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9) / 1e6;
+}
+
+int main(void) {
+    int selectivity[] = {0, 10, 50, 90, 100};
+    int i;
+
+    printf("01\t-------------------------------------------\n");
+    printf("02\tfilter throughput vs selectivity (buffer %d)\n", BUFFER_SIZE);
+    printf("03\t-------------------------------------------\n");
+
+    srand(1);
+    for (i = 0; i < TOKENS; i++)
+        keys[i] = rand() % 100;
+
+    printf("kept\tbatched Mtok/s\tnaive Mtok/s\n");
+    for (i = 0; i < 5; i++)
+        printf("%3d%%\t%14.2f\t%12.2f\n", selectivity[i],
+                run(filter, selectivity[i]), run(naive_filter, selectivity[i]));
+
+    return 0;
+}
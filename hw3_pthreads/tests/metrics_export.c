@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "streams.h"
+#include "metrics.h"
+
+#define METRICS_FILE    "/tmp/streams_metrics.prom"
+#define METRICS_SOCKET  "/tmp/streams_metrics.sock"
+
+/* read a whole snapshot from the exporter socket into 'buf' */
+int scrape(char *buf, int size)
+{
+    struct sockaddr_un addr;
+    int fd, n, total = 0;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, METRICS_SOCKET, sizeof(addr.sun_path) - 1);
+
+    /* the exporter thread might not be listening yet */
+    while (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+        usleep(1000);
+
+    while ((n = read(fd, buf + total, size - total - 1)) > 0)
+        total += n;
+    buf[total] = '\0';
+
+    close(fd);
+    return total;
+}
+
+int main(void) {
+    printf("01\t----------------------------------------------\n");
+    printf("02\t1 successor, 1 non threaded consumer, exporter\n");
+    printf("03\t----------------------------------------------\n");
+
+    int suc_delay = 0;
+    int i;
+    char *text;
+    size_t len;
+    char buf[8192];
+    FILE *f;
+
+    pthread_t s1;
+    pthread_t e1;
+    pthread_t e2;
+
+    stream_t suc1;
+    stream_t cons1;
+
+    metrics_exporter_t file_exporter = {METRICS_FILE, 10, 1};
+    metrics_exporter_t sock_exporter = {"unix:" METRICS_SOCKET, 10, 1};
+
+    init_stream(&suc1, &suc_delay);
+    init_stream(&cons1, NULL);
+
+    stream_connect(&cons1, &suc1);
+
+    metrics_register(&suc1, "successor");
+    metrics_register(&cons1, "consumer");
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+    pthread_create(&e1, &attr, metrics_exporter, (void*)&file_exporter);
+    pthread_create(&e2, &attr, metrics_exporter, (void*)&sock_exporter);
+    pthread_create(&s1, &attr, successor, (void*)&suc1);
+
+    for (i = 0; i < 10; i++)
+        consume_single(&cons1);
+
+    /* give the successor time to fill the buffer back up */
+    usleep(100000);
+
+    f = open_memstream(&text, &len);
+    metrics_snapshot(f);
+    fclose(f);
+    printf("%s", text);
+
+    assert(strstr(text, "# TYPE stream_puts_total counter"));
+    assert(strstr(text, "stream_gets_total{stream=\"successor\",id=\"1\"} 10\n"));
+    assert(strstr(text, "stream_puts_total{stream=\"successor\",id=\"1\"} 15\n"));
+    assert(strstr(text, "stream_consumer_depth{stream=\"consumer\",producer=\"successor\"} 5\n"));
+    free(text);
+
+    scrape(buf, sizeof(buf));
+    printf("scraped %d bytes from %s\n", (int)strlen(buf), METRICS_SOCKET);
+    assert(strstr(buf, "stream_consumer_depth{stream=\"consumer\",producer=\"successor\"} 5\n"));
+
+    sock_exporter.running = 0;
+    file_exporter.running = 0;
+    pthread_join(e1, NULL);
+    pthread_join(e2, NULL);
+
+    f = fopen(METRICS_FILE, "r");
+    assert(f != NULL);
+    len = fread(buf, 1, sizeof(buf) - 1, f);
+    buf[len] = '\0';
+    fclose(f);
+    printf("read %d bytes from %s\n", (int)len, METRICS_FILE);
+    assert(strstr(buf, "stream_gets_total{stream=\"successor\",id=\"1\"} 10\n"));
+
+    pthread_cancel(s1);
+
+    metrics_unregister(&suc1);
+    metrics_unregister(&cons1);
+    kill_stream(&suc1);
+
+    printf("done\n");
+
+    return 0;
+}
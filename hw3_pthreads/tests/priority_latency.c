@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "streams.h"
+
+/*
+   How long a control token takes to get through a saturated stream when
+   it is put into the normal lane behind all the data, versus the high
+   priority lane. Built by 'make bench' with a bigger buffer.
+*/
+
+#define CONTROLS    50
+#define SERVICE_NS  20000   /* time the consumer spends on every token */
+
+int flood_token;
+unsigned long sent[CONTROLS];
+volatile int stop;
+
+/* keep the normal lane full */
+void *flood(void *stream) {
+    stream_t *self = (stream_t*)stream;
+
+    while (!stop)
+        put(self, &flood_token);
+
+    pthread_exit(NULL);
+}
+
+/* work on every token, note when each control token showed up */
+void *service(void *stream) {
+    stream_t *self = (stream_t*)stream;
+    unsigned long *latency = (unsigned long*)self->data;
+    unsigned long start;
+    void *token;
+    int got = 0;
+
+    while (got < CONTROLS) {
+        token = get(self->prod_head);
+        if (token != &flood_token) {
+            latency[got++] = stream_now_ns() - *(unsigned long*)token;
+            continue;
+        }
+
+        start = stream_now_ns();
+        while (stream_now_ns() - start < SERVICE_NS)
+            ;
+    }
+
+    pthread_exit(NULL);
+}
+
+/* send the control tokens every few ms into 'lane', print mean and max latency */
+void run(const char *name, int lane) {
+    pthread_t t_flood, t_service;
+    stream_t src, sink;
+    unsigned long latency[CONTROLS];
+    unsigned long sum = 0, max = 0;
+    int i;
+
+    stop = 0;
+    init_stream(&src, NULL);
+    init_stream(&sink, latency);
+    stream_connect(&sink, &src);
+
+    pthread_create(&t_flood, NULL, flood, &src);
+    pthread_create(&t_service, NULL, service, &sink);
+
+    /* let the buffer fill up first */
+    usleep(50000);
+
+    for (i = 0; i < CONTROLS; i++) {
+        usleep(2000);
+        sent[i] = stream_now_ns();
+        put_lane(&src, &sent[i], lane);
+    }
+
+    pthread_join(t_service, NULL);
+
+    /* nobody reads anymore, unblock the flood by disconnecting */
+    stop = 1;
+    stream_disconnect(&sink, &src);
+    pthread_join(t_flood, NULL);
+
+    for (i = 0; i < CONTROLS; i++) {
+        sum += latency[i];
+        if (latency[i] > max) max = latency[i];
+    }
+
+    printf("%-8s\t%10.3f\t%9.3f\n", name, sum / CONTROLS / 1e6, max / 1e6);
+}
+
+int main(void) {
+    printf("01\t-------------------------------------------------\n");
+    printf("02\tcontrol token latency under saturation (buffer %d)\n", BUFFER_SIZE);
+    printf("03\t-------------------------------------------------\n");
+
+    printf("lane    \tmean ms   \tmax ms\n");
+    run("normal", LANE_NORMAL);
+    run("high", LANE_HIGH);
+
+    return 0;
+}
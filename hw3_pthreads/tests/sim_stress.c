@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/time.h>
+#include "streams.h"
+
+/*
+   Runs the stream configurations from the other tests under the
+   deterministic scheduler (build with -DSIMULATION) for thousands of
+   seeds.  Every consumer checks that it sees each token exactly once
+   and in order, per priority lane.  A failing seed can be replayed with:
+
+        tests/sim_stress 1 <seed>
+*/
+
+#define TOKENS      20
+#define MAX_STEPS   100000
+#define MAX_PROD    3
+
+/* what one simulated consumer is supposed to do */
+typedef struct reader_t {
+    stream_t *self;         /* our stream */
+    stream_t *from;         /* producer we disconnect from and reconnect to */
+    int count;              /* how many tokens to get in total */
+    int reconnect_at;       /* after this many tokens disconnect and reconnect, 0 to never */
+    int connect_late;       /* connect to 'from' ourselves, 1 after a few scheduling points, 2 once its buffer is full */
+    int batched;            /* use get_batch() instead of get() */
+} reader_t;
+
+/* which kind of producer a run uses */
+enum counter_kind {COUNT_SINGLE, COUNT_BATCH, COUNT_LANES};
+
+char failure[256];
+
+void fail(const char *fmt, ...)
+{
+    va_list ap;
+    if (failure[0]) return;
+    va_start(ap, fmt);
+    vsnprintf(failure, sizeof(failure), fmt, ap);
+    va_end(ap);
+}
+
+/* put 1,2,3,4... forever */
+void *counter(void *stream)
+{
+    stream_t *self = (stream_t*)stream;
+    long i;
+
+    for (i = 1; ; i++)
+        put(self, (void*)i);
+
+    return NULL;
+}
+
+/* put 1,2,3,4... forever in batches of random size */
+void *counter_batch(void *stream)
+{
+    stream_t *self = (stream_t*)stream;
+    void *batch[8];
+    long i = 1;
+    int j, n;
+
+    while (1) {
+        n = 1 + sim_random() % 8;
+        for (j = 0; j < n; j++)
+            batch[j] = (void*)i++;
+        put_batch(self, batch, n);
+    }
+
+    return NULL;
+}
+
+/* put 1,2,3,4... into the normal lane and -1,-2,-3... into the high lane */
+void *counter_lanes(void *stream)
+{
+    stream_t *self = (stream_t*)stream;
+    long normal = 1, high = -1;
+
+    while (1) {
+        if (sim_random() % 4 == 0)
+            put_lane(self, (void*)high--, LANE_HIGH);
+        else
+            put(self, (void*)normal++);
+    }
+
+    return NULL;
+}
+
+/*
+   Get tokens round robin from every producer we are connected to. Tokens
+   from one producer and lane have to go one further from zero, except
+   right after connecting where we pick up at whatever is still in the
+   buffer.  Negative tokens come through the high lane.
+*/
+void *reader(void *arg)
+{
+    reader_t *r = (reader_t*)arg;
+    producer_t *p;
+    long last[MAX_PROD][2] = {{0}};
+    int fresh[MAX_PROD][2] = {{0}};
+    void *batch[8];
+    long v;
+    int got = 0;
+    int i, j, l, n;
+
+    if (r->connect_late == 1) {
+        n = sim_random() % 10;
+        for (i = 0; i < n; i++) sim_yield();
+        stream_connect(r->self, r->from);
+        fresh[0][0] = fresh[0][1] = 1;
+    }
+
+    /* the producer is stuck until somebody reads what it put before
+     * anyone was connected, and we have to get all of it from 1 on */
+    if (r->connect_late == 2) {
+        while (r->from->lanes[LANE_NORMAL].put_seq < BUFFER_SIZE)
+            sim_yield();
+        stream_connect(r->self, r->from);
+    }
+
+    while (got < r->count && !failure[0]) {
+
+        if (r->reconnect_at && got >= r->reconnect_at) {
+            r->reconnect_at = 0;
+            stream_disconnect(r->self, r->from);
+            n = sim_random() % 10;
+            for (i = 0; i < n; i++) sim_yield();
+            stream_connect(r->self, r->from);
+            fresh[0][0] = fresh[0][1] = 1;
+        }
+
+        for (p = r->self->prod_head, i = 0; p != NULL && got < r->count; p = p->next, i++) {
+            if (r->batched) {
+                n = 1 + sim_random() % 8;
+                if (n > r->count - got) n = r->count - got;
+                n = get_batch(p, batch, n);
+            } else {
+                batch[0] = get(p);
+                n = 1;
+            }
+
+            for (j = 0; j < n; j++) {
+                v = (long)batch[j];
+                l = v < 0;
+                if (l) v = -v;
+
+                if (v < 1 || (!fresh[i][l] && v != last[i][l] + 1))
+                    fail("stream %d got %ld from stream %d lane %d after %ld",
+                            r->self->id, v, p->stream->id, l, last[i][l]);
+
+                last[i][l] = v;
+                fresh[i][l] = 0;
+                got++;
+            }
+        }
+    }
+
+    /* stop holding up the producers for the consumers still running */
+    while (r->self->prod_head != NULL)
+        stream_disconnect(r->self, r->self->prod_head->stream);
+
+    return NULL;
+}
+
+/* run one configuration under 'seed', returns 0 if everything checked out */
+int run(unsigned long seed, const char *name, int producers, int consumers,
+        int reconnect_at, int connect_late, int batched, enum counter_kind kind)
+{
+    stream_t suc[MAX_PROD];
+    stream_t cons[4];
+    reader_t readers[4];
+    enum sim_result rt;
+    int i, j;
+
+    failure[0] = '\0';
+    sim_init(seed, MAX_STEPS);
+
+    for (i = 0; i < producers; i++)
+        init_stream(&suc[i], NULL);
+
+    for (i = 0; i < consumers; i++) {
+        init_stream(&cons[i], NULL);
+        readers[i].self = &cons[i];
+        readers[i].from = &suc[0];
+        readers[i].count = TOKENS;
+        readers[i].reconnect_at = 0;
+        readers[i].connect_late = 0;
+        readers[i].batched = batched;
+    }
+
+    /* the last consumer is the odd one out */
+    readers[consumers-1].reconnect_at = reconnect_at;
+    readers[consumers-1].connect_late = connect_late;
+
+    for (i = 0; i < consumers; i++)
+        for (j = 0; j < producers; j++)
+            if (!readers[i].connect_late)
+                stream_connect(&cons[i], &suc[j]);
+
+    for (i = 0; i < producers; i++)
+        sim_spawn(kind == COUNT_BATCH ? counter_batch :
+                  kind == COUNT_LANES ? counter_lanes : counter, &suc[i], 1);
+    for (i = 0; i < consumers; i++)
+        sim_spawn(reader, &readers[i], 0);
+
+    rt = sim_run();
+
+    if (rt == SIM_DEADLOCK) fail("deadlock");
+    if (rt == SIM_TIMEOUT) fail("no progress after %d steps", MAX_STEPS);
+
+    if (failure[0]) {
+        printf("seed %lu: %s: %s\n", seed, name, failure);
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long seeds = argc > 1 ? strtoul(argv[1], NULL, 0) : 10000;
+    unsigned long first = argc > 2 ? strtoul(argv[2], NULL, 0) : 1;
+    unsigned long seed;
+    struct timeval start, end;
+    double secs;
+    int failed = 0;
+
+    printf("01\t--------------------------------------------\n");
+    printf("02\tdeterministic schedule fuzzing of the streams\n");
+    printf("03\t--------------------------------------------\n");
+
+    gettimeofday(&start, NULL);
+
+    for (seed = first; seed < first + seeds; seed++) {
+        failed |= run(seed, "one to many", 1, 3, 0, 0, 0, COUNT_SINGLE);
+        failed |= run(seed, "many to one", 3, 1, 0, 0, 0, COUNT_SINGLE);
+        failed |= run(seed, "many to many", 2, 2, 0, 0, 0, COUNT_SINGLE);
+        failed |= run(seed, "disconnect reconnect", 1, 2, 5, 0, 0, COUNT_SINGLE);
+        failed |= run(seed, "connect while running", 1, 2, 0, 1, 0, COUNT_SINGLE);
+        failed |= run(seed, "connect to a full buffer", 1, 1, 0, 2, 0, COUNT_SINGLE);
+        failed |= run(seed, "only consumer reconnects", 1, 1, 5, 0, 0, COUNT_SINGLE);
+        failed |= run(seed, "batched many to many", 2, 2, 0, 0, 1, COUNT_BATCH);
+        failed |= run(seed, "batched disconnect reconnect", 1, 2, 5, 0, 1, COUNT_BATCH);
+        failed |= run(seed, "lanes many to many", 2, 2, 0, 0, 0, COUNT_LANES);
+        failed |= run(seed, "lanes batched disconnect reconnect", 1, 2, 5, 0, 1, COUNT_LANES);
+    }
+
+    gettimeofday(&end, NULL);
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+
+    printf("%lu seeds in %.2f s (%.0f seeds/s)\n", seeds, secs, seeds / secs);
+    printf(failed ? "FAILED\n" : "done\n");
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include "streams.h"
+#include "window.h"
+
+/* put data tokens 0,1,2,3... at time 0,1,2,3... and a watermark every 5 ticks */
+void *timed_successor(void *stream) {
+    stream_t *self = (stream_t*)stream;
+    long i;
+
+    for (i=0 ; ; i++) {
+        put(self, (void*)data_token(i, (int)i));
+        if (i % 5 == 4)
+            put(self, (void*)watermark_token(i+1));
+    }
+    pthread_exit(NULL);
+}
+
+/*
+   Put the tokens of 'script' in order: a data token with value and ts 'x'
+   for every x > 0, a watermark at -x for every x < 0, up to the 0 that
+   ends it.
+*/
+long *script;
+
+void *scripted_successor(void *stream) {
+    stream_t *self = (stream_t*)stream;
+    long *s;
+
+    for (s = script; *s != 0; s++) {
+        if (*s > 0)
+            put(self, (void*)data_token(*s, (int)*s));
+        else
+            put(self, (void*)watermark_token(-*s));
+    }
+    pthread_exit(NULL);
+}
+
+/* get the next closed window out of 'cons' skipping forwarded watermarks */
+token_t *next_window(stream_t *cons) {
+    token_t *t;
+    do {
+        t = (token_t*)consume_single(cons);
+    } while (t->kind != TOKEN_WINDOW);
+    return t;
+}
+
+/*
+   Run a successor through a single window stage and check the first
+   'n' windows against the expected start, count and sum of each.
+*/
+void run(const char *name, enum window_mode mode, long size, long slide,
+         int n, long *start, int *count, long *sum)
+{
+    pthread_t s1;
+    pthread_t w1;
+
+    stream_t suc1;
+    stream_t win1;
+    stream_t cons1;
+
+    window_t w;
+    token_t *t;
+    int i;
+
+    printf("%s\n", name);
+
+    init_window(&w, mode, size, slide);
+
+    init_stream(&suc1, NULL);
+    init_stream(&win1, &w);
+    init_stream(&cons1, NULL);
+
+    stream_connect(&win1, &suc1);
+    stream_connect(&cons1, &win1);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+    pthread_create(&s1, &attr, timed_successor, (void*)&suc1);
+    pthread_create(&w1, &attr, window, (void*)&win1);
+
+    for (i = 0; i < n; i++) {
+        t = next_window(&cons1);
+        printf("  [%ld, %ld) count %d sum %ld min %d max %d\n",
+                t->start, t->ts, t->agg.count, t->agg.sum, t->agg.min, t->agg.max);
+        assert(t->start == start[i]);
+        assert(t->ts == start[i] + size);
+        assert(t->agg.count == count[i]);
+        assert(t->agg.sum == sum[i]);
+        assert(t->agg.min == (int)start[i]);
+        assert(t->agg.max == (int)(start[i] + count[i] - 1));
+    }
+
+    pthread_cancel(w1);
+    pthread_cancel(s1);
+    pthread_join(w1, NULL);
+    pthread_join(s1, NULL);
+
+    kill_stream(&suc1);
+}
+
+/*
+   Run 'tokens' through a single time window stage and check that the
+   windows that come out have the expected start, count and sum.
+*/
+void run_script(const char *name, long size, long slide, long *tokens,
+                int n, long *start, int *count, long *sum)
+{
+    pthread_t s1;
+    pthread_t w1;
+
+    stream_t suc1;
+    stream_t win1;
+    stream_t cons1;
+
+    window_t w;
+    token_t *t;
+    int i;
+
+    printf("%s\n", name);
+
+    script = tokens;
+    init_window(&w, WINDOW_TIME, size, slide);
+
+    init_stream(&suc1, NULL);
+    init_stream(&win1, &w);
+    init_stream(&cons1, NULL);
+
+    stream_connect(&win1, &suc1);
+    stream_connect(&cons1, &win1);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+    pthread_create(&s1, &attr, scripted_successor, (void*)&suc1);
+    pthread_create(&w1, &attr, window, (void*)&win1);
+
+    for (i = 0; i < n; i++) {
+        t = next_window(&cons1);
+        printf("  [%ld, %ld) count %d sum %ld\n", t->start, t->ts, t->agg.count, t->agg.sum);
+        assert(t->start == start[i]);
+        assert(t->ts == start[i] + size);
+        assert(t->agg.count == count[i]);
+        assert(t->agg.sum == sum[i]);
+    }
+
+    pthread_cancel(w1);
+    pthread_join(w1, NULL);
+    pthread_join(s1, NULL);
+
+    kill_stream(&suc1);
+}
+
+int main(void) {
+    printf("01\t----------------------------------------\n");
+    printf("02\t1 successor, 1 window stage, 1 consumer\n");
+    printf("03\ttumbling, sliding and count windows\n");
+    printf("04\t----------------------------------------\n");
+
+    long tumble_start[] = {0, 10, 20};
+    int tumble_count[] = {10, 10, 10};
+    long tumble_sum[] = {45, 145, 245};
+    run("tumbling time window of 10", WINDOW_TIME, 10, 10,
+        3, tumble_start, tumble_count, tumble_sum);
+
+    long slide_start[] = {0, 5, 10, 15};
+    int slide_count[] = {10, 10, 10, 10};
+    long slide_sum[] = {45, 95, 145, 195};
+    run("sliding time window of 10 every 5", WINDOW_TIME, 10, 5,
+        4, slide_start, slide_count, slide_sum);
+
+    long count_start[] = {0, 2, 4};
+    int count_count[] = {4, 4, 4};
+    long count_sum[] = {6, 14, 22};
+    run("count window of 4 every 2", WINDOW_COUNT, 4, 2,
+        3, count_start, count_count, count_sum);
+
+    /* data out of order between watermarks still lands in its own window */
+    long late_tokens[] = {25, 5, -10, -30, 0};
+    long late_start[] = {0, 20};
+    int late_count[] = {1, 1};
+    long late_sum[] = {5, 25};
+    run_script("tumbling time window of 10, out of order", 10, 10, late_tokens,
+        2, late_start, late_count, late_sum);
+
+    long back_tokens[] = {7, 3, -10, -15, 0};
+    long back_start[] = {0, 5};
+    int back_count[] = {2, 1};
+    long back_sum[] = {10, 7};
+    run_script("sliding time window of 10 every 5, out of order", 10, 5, back_tokens,
+        2, back_start, back_count, back_sum);
+
+    /* 4 is behind the watermark at 6 and dropped, 8 still makes it */
+    long mixed_tokens[] = {9, 2, 6, 1, -6, 4, 8, 13, 11, -20, 0};
+    long mixed_start[] = {0, 10};
+    int mixed_count[] = {5, 2};
+    long mixed_sum[] = {26, 24};
+    run_script("tumbling time window of 10, late data", 10, 10, mixed_tokens,
+        2, mixed_start, mixed_count, mixed_sum);
+
+    printf("done\n");
+
+    return 0;
+}
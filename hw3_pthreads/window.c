@@ -0,0 +1,340 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <string.h>
+#include "window.h"
+
+/* aggregate of nothing, combining with it changes nothing */
+static agg_t agg_identity(void)
+{
+    agg_t a = {0, 0, INT_MAX, INT_MIN};
+    return a;
+}
+
+static agg_t agg_combine(agg_t a, agg_t b)
+{
+    a.count += b.count;
+    a.sum += b.sum;
+    if (b.min < a.min) a.min = b.min;
+    if (b.max > a.max) a.max = b.max;
+    return a;
+}
+
+static agg_t agg_single(int value)
+{
+    agg_t a = {1, value, value, value};
+    return a;
+}
+
+/*
+ * Two stack queue.  Values are pushed onto the back stack and popped off
+ * of the front stack.  Each slot remembers the aggregate of itself and
+ * everything below it so the aggregate of the whole queue is just the
+ * combination of the two stack tops.  When the front stack runs dry the
+ * back stack is flipped onto it, which is where the amortized O(1) comes
+ * from since every value is flipped at most once.
+ */
+void aggq_init(aggq_t *q)
+{
+    q->cap = 16;
+    q->front = (agg_entry_t*)malloc(q->cap * sizeof(agg_entry_t));
+    q->back = (agg_entry_t*)malloc(q->cap * sizeof(agg_entry_t));
+    q->front_len = 0;
+    q->back_len = 0;
+}
+
+void aggq_kill(aggq_t *q)
+{
+    free(q->front);
+    free(q->back);
+    q->front = NULL;
+    q->back = NULL;
+    q->cap = 0;
+}
+
+int aggq_len(aggq_t *q)
+{
+    return q->front_len + q->back_len;
+}
+
+void aggq_push(aggq_t *q, long ts, int value)
+{
+    agg_entry_t *e;
+    agg_t below;
+
+    /* both stacks have the same capacity so a flip always fits */
+    if (aggq_len(q) == q->cap) {
+        q->cap *= 2;
+        q->front = (agg_entry_t*)realloc(q->front, q->cap * sizeof(agg_entry_t));
+        q->back = (agg_entry_t*)realloc(q->back, q->cap * sizeof(agg_entry_t));
+    }
+
+    below = q->back_len ? q->back[q->back_len-1].agg : agg_identity();
+
+    e = &q->back[q->back_len++];
+    e->ts = ts;
+    e->value = value;
+    e->agg = agg_combine(below, agg_single(value));
+}
+
+/* move everything from the back stack onto the front stack */
+static void aggq_flip(aggq_t *q)
+{
+    agg_entry_t *e;
+    agg_t below = agg_identity();
+
+    while (q->back_len > 0) {
+        e = &q->front[q->front_len++];
+        *e = q->back[--q->back_len];
+        e->agg = agg_combine(below, agg_single(e->value));
+        below = e->agg;
+    }
+}
+
+agg_entry_t *aggq_front(aggq_t *q)
+{
+    if (q->front_len == 0) aggq_flip(q);
+    if (q->front_len == 0) return NULL;
+    return &q->front[q->front_len-1];
+}
+
+void aggq_pop(aggq_t *q)
+{
+    if (aggq_front(q) != NULL) q->front_len--;
+}
+
+agg_t aggq_query(aggq_t *q)
+{
+    agg_t a = agg_identity();
+    if (q->front_len) a = agg_combine(a, q->front[q->front_len-1].agg);
+    if (q->back_len) a = agg_combine(a, q->back[q->back_len-1].agg);
+    return a;
+}
+
+static token_t *new_token(enum token_kind kind, long ts)
+{
+    token_t *t = (token_t*)malloc(sizeof(token_t));
+    memset(t, 0, sizeof(token_t));
+    t->kind = kind;
+    t->ts = ts;
+    return t;
+}
+
+token_t *data_token(long ts, int value)
+{
+    token_t *t = new_token(TOKEN_DATA, ts);
+    t->value = value;
+    return t;
+}
+
+token_t *watermark_token(long ts)
+{
+    return new_token(TOKEN_WATERMARK, ts);
+}
+
+/*
+ * 'size' and 'slide' are in timestamp units for WINDOW_TIME and in tokens
+ * for WINDOW_COUNT. A tumbling window is just a sliding window where
+ * 'slide' equals 'size'.
+ */
+void init_window(window_t *w, enum window_mode mode, long size, long slide)
+{
+    w->mode = mode;
+    w->size = size;
+    w->slide = slide;
+    w->start = 0;
+    w->seen = 0;
+    w->late = 0;
+    w->watermark = LONG_MIN;
+    aggq_init(&w->q);
+    w->pending_cap = 16;
+    w->pending = (agg_entry_t*)malloc(w->pending_cap * sizeof(agg_entry_t));
+    w->npending = 0;
+}
+
+void kill_window(window_t *w)
+{
+    aggq_kill(&w->q);
+    free(w->pending);
+    w->pending = NULL;
+    w->pending_cap = 0;
+}
+
+/*
+ * Data can show up in any order between two watermarks, so tokens wait
+ * in a min heap on their timestamp until a watermark lets them into a
+ * window. That way they always go into 'q' oldest first and evicting
+ * from its front evicts by time.
+ */
+static void pending_push(window_t *w, long ts, int value)
+{
+    agg_entry_t e;
+    int i, parent;
+
+    if (w->npending == w->pending_cap) {
+        w->pending_cap *= 2;
+        w->pending = (agg_entry_t*)realloc(w->pending, w->pending_cap * sizeof(agg_entry_t));
+    }
+
+    for (i = w->npending++; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if (w->pending[parent].ts <= ts) break;
+        w->pending[i] = w->pending[parent];
+    }
+
+    e.ts = ts;
+    e.value = value;
+    w->pending[i] = e;
+}
+
+/* oldest pending token, NULL if there is none */
+static agg_entry_t *pending_front(window_t *w)
+{
+    return w->npending ? &w->pending[0] : NULL;
+}
+
+static void pending_pop(window_t *w)
+{
+    agg_entry_t last;
+    int i = 0, child;
+
+    if (w->npending == 0) return;
+
+    last = w->pending[--w->npending];
+    while ((child = 2 * i + 1) < w->npending) {
+        if (child + 1 < w->npending && w->pending[child + 1].ts < w->pending[child].ts)
+            child++;
+        if (last.ts <= w->pending[child].ts) break;
+        w->pending[i] = w->pending[child];
+        i = child;
+    }
+    w->pending[i] = last;
+}
+
+/* put the aggregate of the window [start, end) into 'out' */
+static void window_emit(window_t *w, stream_t *out, long start, long end)
+{
+    token_t *t = new_token(TOKEN_WINDOW, end);
+    t->start = start;
+    t->agg = aggq_query(&w->q);
+    put(out, (void*)t);
+}
+
+/*
+ * Start of the first window that ends after 'ts', but never before the
+ * oldest window that is still open.
+ */
+static long window_after(window_t *w, long ts)
+{
+    long start;
+
+    if (ts - w->size < 0) return w->start;
+
+    start = ((ts - w->size) / w->slide + 1) * w->slide;
+    return start > w->start ? start : w->start;
+}
+
+/*
+ * Evict tokens that slid out of the front of the oldest open window and
+ * pull in pending tokens that now fall inside of it. Only tokens behind
+ * the watermark are pulled in, anything newer could still have older
+ * tokens show up after it.
+ */
+static void window_fill(window_t *w)
+{
+    agg_entry_t *e;
+
+    while ((e = aggq_front(&w->q)) != NULL && e->ts < w->start)
+        aggq_pop(&w->q);
+
+    while ((e = pending_front(w)) != NULL && e->ts < w->start + w->size && e->ts < w->watermark) {
+        if (e->ts >= w->start)
+            aggq_push(&w->q, e->ts, e->value);
+        pending_pop(w);
+    }
+}
+
+/*
+ * Close every window that ends at or before the watermark 'ts'. Empty
+ * stretches are skipped instead of emitting empty windows.
+ */
+static void window_advance(window_t *w, stream_t *out, long ts)
+{
+    agg_entry_t *e;
+
+    if (ts > w->watermark) w->watermark = ts;
+    window_fill(w);
+
+    while (w->start + w->size <= ts) {
+
+        if (aggq_len(&w->q) > 0)
+            window_emit(w, out, w->start, w->start + w->size);
+
+        w->start += w->slide;
+        window_fill(w);
+
+        /* nothing left open, jump ahead to where the data is */
+        if (aggq_len(&w->q) == 0) {
+            e = pending_front(w);
+            w->start = window_after(w, e ? e->ts : ts);
+            window_fill(w);
+        }
+    }
+}
+
+/*
+ * Feed a single token into the window. Closed windows are put into 'out'
+ * as TOKEN_WINDOW tokens and watermarks are passed along after the windows
+ * they close so downstream stages see them in order.
+ */
+void window_push(window_t *w, stream_t *out, token_t *t)
+{
+    if (t->kind == TOKEN_WATERMARK) {
+        if (w->mode == WINDOW_TIME)
+            window_advance(w, out, t->ts);
+        put(out, (void*)t);
+        return;
+    }
+
+    if (t->kind != TOKEN_DATA) return;
+
+    if (w->mode == WINDOW_COUNT) {
+        aggq_push(&w->q, w->seen, t->value);
+        w->seen++;
+
+        if (aggq_len(&w->q) > w->size)
+            aggq_pop(&w->q);
+
+        if (w->seen >= w->size && (w->seen - w->size) % w->slide == 0)
+            window_emit(w, out, w->seen - w->size, w->seen);
+
+        return;
+    }
+
+    /* the watermark already promised nothing this old would show up */
+    if (t->ts < w->watermark || t->ts < w->start) {
+        w->late++;
+        return;
+    }
+
+    pending_push(w, t->ts, t->value);
+}
+
+/* aggregate all token_t's from the self stream over (window_t*)self->data */
+void *window(void *stream)
+{
+    stream_t *self = (stream_t *)stream;
+    window_t *w = (window_t *)self->data;
+    producer_t *p;
+
+    while (true) {
+        p = self->prod_head;
+        while (p != NULL)
+        {
+            window_push(w, self, (token_t*)get(p));
+            p = p->next;
+        }
+    }
+    pthread_exit(NULL);
+}
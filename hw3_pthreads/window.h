@@ -0,0 +1,89 @@
+#include "streams.h"
+
+#ifndef __WINDOW_H__
+#define __WINDOW_H__
+
+/*
+   Windowed aggregation over streams of token_t's.  Data tokens carry an
+   event timestamp and a value, watermark tokens promise that no more data
+   older than their timestamp will follow.  A window stage keeps the tokens
+   of the open window in a two stack queue so adding or evicting a token
+   is O(1) (amortized) for count, sum, min and max.
+*/
+
+/* what a token_t flowing through a windowed stream holds */
+enum token_kind {TOKEN_DATA, TOKEN_WATERMARK, TOKEN_WINDOW};
+
+/* windows are either measured in event time or in number of tokens */
+enum window_mode {WINDOW_TIME, WINDOW_COUNT};
+
+typedef struct agg_t agg_t;
+typedef struct token_t token_t;
+typedef struct agg_entry_t agg_entry_t;
+typedef struct aggq_t aggq_t;
+typedef struct window_t window_t;
+
+struct agg_t {
+    int count;              /* how many values were combined */
+    long sum;               /* sum of the values */
+    int min;                /* smallest value */
+    int max;                /* largest value */
+};
+
+struct token_t {
+    enum token_kind kind;   /* data, watermark or closed window */
+    long ts;                /* event time / watermark time / end of window */
+    int value;              /* payload of a data token */
+    long start;             /* start of a closed window */
+    agg_t agg;              /* aggregate of a closed window */
+};
+
+/*
+   One slot of a two stack queue.  'agg' is the aggregate of this value and
+   every value below it on the same stack.
+*/
+struct agg_entry_t {
+    long ts;
+    int value;
+    agg_t agg;
+};
+
+struct aggq_t {
+    agg_entry_t *front;     /* oldest value on top, popped from here */
+    agg_entry_t *back;      /* newest value on top, pushed onto here */
+    int front_len;
+    int back_len;
+    int cap;                /* capacity of each stack */
+};
+
+struct window_t {
+    enum window_mode mode;  /* time or count based */
+    long size;              /* width of a window */
+    long slide;             /* distance between window starts, size for tumbling */
+    long start;             /* start of the oldest open window */
+    long seen;              /* number of data tokens seen (count mode) */
+    long late;              /* data tokens dropped for being behind a watermark */
+    long watermark;         /* latest watermark seen (time mode) */
+    aggq_t q;               /* tokens inside the oldest open window, oldest first */
+    agg_entry_t *pending;   /* tokens not in a window yet, a min heap on ts (time mode) */
+    int npending;           /* tokens in 'pending' */
+    int pending_cap;        /* room in 'pending' */
+};
+
+void aggq_init(aggq_t *q);
+void aggq_kill(aggq_t *q);
+void aggq_push(aggq_t *q, long ts, int value);
+void aggq_pop(aggq_t *q);
+int aggq_len(aggq_t *q);
+agg_entry_t *aggq_front(aggq_t *q);
+agg_t aggq_query(aggq_t *q);
+
+token_t *data_token(long ts, int value);
+token_t *watermark_token(long ts);
+
+void init_window(window_t *w, enum window_mode mode, long size, long slide);
+void kill_window(window_t *w);
+void window_push(window_t *w, stream_t *out, token_t *t);
+void *window(void *stream);
+
+#endif
@@ -1,90 +1,363 @@
 #include "buddy.h"
 
+#define LEFT(i)     (2 * (i) + 1)
+#define RIGHT(i)    (2 * (i) + 2)
+#define PARENT(i)   (((i) - 1) / 2)
+#define MAX(a, b)   ((a) > (b) ? (a) : (b))
+
+/*
+ * What the block map says about the smallest block at some index. Every
+ * smallest block of an allocation has its order, and since pages are
+ * aligned to their size that is enough to find where the page starts.
+ */
+#define BLOCK_ORDER     0x3f    /* 1 + order of the allocation this is part of, 0 if none */
+#define BLOCK_CACHED    0x80    /* the allocation was freed into a magazine, only on its first block */
+
+/* node of the page of order 'k' starting at 'idx' */
+#define NODE(b, idx, k) ((1 << ((b)->order - (k))) - 1 + ((idx) >> (k)))
+
+/* the pool behind the buddy_* functions, and its memory */
+static buddy_t *buddy_default;
 char *buddy_pool;
-struct node_t *buddy_head;
+
+#ifdef NONKERNEL
+/* threads get a magazine each, round robin */
+static int buddy_next_mag;
+static __thread int buddy_thread_mag = -1;
+
+static int buddy_cpu(void)
+{
+    if (buddy_thread_mag < 0)
+        buddy_thread_mag = __sync_fetch_and_add(&buddy_next_mag, 1) % BUDDY_NR_MAGS;
+    return buddy_thread_mag;
+}
+#else
+#define buddy_cpu() (raw_smp_processor_id() % BUDDY_NR_MAGS)
+#endif
 
 /*
- * Attempt to allocate of pool of size 'size'
- * and intialize the head node. Returns -1
- * if either pool or head node could not be
- * allocated.
+ * Attempt to allocate a pool of size 'size' on
+ * NUMA node 'node' (-1 for any) and the array
+ * holding its tree. Pools that are not a power
+ * of 2 are rounded down to one. Returns NULL if
+ * either pool or tree could not be allocated.
  */
-int buddy_init(int size)
+buddy_t *buddy_create_node(int size, int node)
 {
+    buddy_t *b;
+    int order, i;
+    long nodes;
+
+    b = (buddy_t*)bmalloc_node(sizeof(buddy_t), node);
+    if (!b) return NULL;
+
+    b->order = -1;
+    b->pool = NULL;
+    b->tree = NULL;
+    b->blocks = NULL;
+
+    block_init(&b->lock);
+    memset(&b->stats, 0, sizeof(b->stats));
+    for (i = 0; i < BUDDY_NR_MAGS; i++) {
+        block_init(&b->mags[i].lock);
+        memset(b->mags[i].count, 0, sizeof(b->mags[i].count));
+        b->mags[i].allocs = 0;
+        b->mags[i].frees = 0;
+    }
+
+    /* an empty pool can't hand out anything */
+    if (size < (1 << BUDDY_MIN_ORDER)) return b;
+
+    /* biggest power of 2 that fits */
+    for (order = BUDDY_MIN_ORDER; order < BUDDY_MAX_ORDER && (2 << order) <= size; order++)
+        ;
+
     /* allocate space for all the pages */
-    buddy_pool = bmalloc(size);
-    if (!buddy_pool) {
-        return -1;
+    b->pool = bmalloc_pool(1 << order, node);
+    if (!b->pool) {
+        buddy_destroy(b);
+        return NULL;
     }
 
-    /* allocate the head node of the tree */
-    buddy_head = (node_t*)bmalloc(sizeof(node_t));
-    if (!buddy_head) {
-        return -1;
+    /* a full tree down to the smallest blocks, allocated once so
+     * splitting and merging never have to allocate anything */
+    nodes = (2L << (order - BUDDY_MIN_ORDER)) - 1;
+    b->tree = (node_t*)bmalloc_node(nodes * sizeof(node_t), node);
+    if (!b->tree) {
+        buddy_destroy(b);
+        return NULL;
     }
 
-    buddy_head->left = NULL;
-    buddy_head->right = NULL;
-    buddy_head->state = FREE;
-    buddy_head->size = size;
-    buddy_head->idx = 0;
+    b->blocks = (unsigned char*)bmalloc_node(1 << (order - BUDDY_MIN_ORDER), node);
+    if (!b->blocks) {
+        buddy_destroy(b);
+        return NULL;
+    }
+    memset(b->blocks, 0, 1 << (order - BUDDY_MIN_ORDER));
 
-    return 0;
+    b->order = order;
+    b->tree[0].state = FREE;
+    b->tree[0].longest = order + 1;
+    b->stats.size = 1 << order;
+    b->stats.free[order] = 1;
+
+    return b;
+}
+
+buddy_t *buddy_create(int size)
+{
+    return buddy_create_node(size, -1);
+}
+
+/*
+ * Attempt to allocate a page of order 'k' out of
+ * the tree, returns page index on success or -1 if
+ * the requested size could not fit. Called with
+ * the tree locked.
+ *
+ * Every node knows the biggest free block below
+ * it so a request that can't fit is turned down
+ * at the root, and one that can goes straight
+ * down to the leftmost block that fits.
+ */
+static int _buddy_alloc(buddy_t *b, int k)
+{
+    int i = 0, idx = 0;
+    int order;
+
+    /* nothing in the whole pool is big enough */
+    if (b->tree[0].longest < k + 1) return -1;
+
+    for (order = b->order; order > k || b->tree[i].state != FREE; order--) {
+
+        /* we are too big, mark this node as SPLIT with two free halves */
+        if (b->tree[i].state == FREE) {
+            b->tree[i].state = SPLIT;
+            b->tree[LEFT(i)].state = FREE;
+            b->tree[LEFT(i)].longest = order;
+            b->tree[RIGHT(i)].state = FREE;
+            b->tree[RIGHT(i)].longest = order;
+            b->stats.free[order]--;
+            b->stats.free[order - 1] += 2;
+            b->stats.splits++;
+        }
+
+        /* left side first so we always hand out the lowest index */
+        if (b->tree[LEFT(i)].longest >= k + 1) {
+            i = LEFT(i);
+        } else {
+            i = RIGHT(i);
+            idx += 1 << (order - 1);
+        }
+    }
+
+    b->tree[i].state = ALLOC;
+    b->tree[i].longest = 0;
+    b->stats.free[k]--;
+    b->stats.allocated += 1 << k;
+    b->stats.allocs++;
+
+    /* the biggest free block changed all the way up */
+    while (i > 0) {
+        i = PARENT(i);
+        b->tree[i].longest = MAX(b->tree[LEFT(i)].longest, b->tree[RIGHT(i)].longest);
+    }
+
+    memset(&b->blocks[idx >> BUDDY_MIN_ORDER], k + 1, 1 << (k - BUDDY_MIN_ORDER));
+    return idx;
+}
+
+/*
+ * Mark the page of order 'order' starting at 'idx'
+ * as FREE in the tree and the block map. Also merge
+ * two pages together if they are buddies and both
+ * free. Called with the tree locked after 'idx' was
+ * checked to be a page.
+ */
+static void _buddy_free(buddy_t *b, int idx, int order)
+{
+    int i = NODE(b, idx, order);
+
+    memset(&b->blocks[idx >> BUDDY_MIN_ORDER], 0, 1 << (order - BUDDY_MIN_ORDER));
+
+    b->tree[i].state = FREE;
+    b->tree[i].longest = order + 1;
+    b->stats.free[order]++;
+    b->stats.allocated -= 1 << order;
+
+    /* merge every split on the way up whose halves are both free */
+    while (i > 0) {
+        i = PARENT(i);
+        order++;
+        if (b->tree[LEFT(i)].state == FREE && b->tree[RIGHT(i)].state == FREE) {
+            b->tree[i].state = FREE;
+            b->tree[i].longest = order + 1;
+            b->stats.free[order - 1] -= 2;
+            b->stats.free[order]++;
+            b->stats.merges++;
+        } else {
+            b->tree[i].longest = MAX(b->tree[LEFT(i)].longest, b->tree[RIGHT(i)].longest);
+        }
+    }
+}
+
+/*
+ * Give the oldest 'n' blocks of order 'o' in magazine 'm'
+ * back to the tree. Called with the magazine locked.
+ */
+static void mag_flush(buddy_t *b, magazine_t *m, int o, int n)
+{
+    int j;
+
+    block(&b->lock);
+    for (j = 0; j < n; j++) {
+        _buddy_free(b, m->blocks[o][j], o + BUDDY_MIN_ORDER);
+    }
+    bunlock(&b->lock);
+
+    m->count[o] -= n;
+    memmove(m->blocks[o], m->blocks[o] + n, m->count[o] * sizeof(int));
+}
+
+/* give every cached block back to the tree, returns how many there were */
+static int mag_drain(buddy_t *b)
+{
+    int i, o, n = 0;
+
+    for (i = 0; i < BUDDY_NR_MAGS; i++) {
+        block(&b->mags[i].lock);
+        for (o = 0; o < BUDDY_MAG_ORDERS; o++) {
+            n += b->mags[i].count[o];
+            mag_flush(b, &b->mags[i], o, b->mags[i].count[o]);
+        }
+        bunlock(&b->mags[i].lock);
+    }
+
+    return n;
 }
 
 /*
  * Attempt to allocate a page of size 'size'
  * returns page index on success or -1 if the
  * requested size could not fit.
+ *
+ * Small pages come out of this CPU's magazine
+ * if it has one, everything else out of the
+ * tree. If the tree is out of space the blocks
+ * sitting in the magazines are given back and
+ * we try once more.
  */
-int _buddy_alloc(node_t *n, int size)
+int buddy_pool_alloc(buddy_t *b, int size)
 {
-    int rt = -1;
+    magazine_t *m;
+    int k, o, idx;
+
+    if (size <= 0 || b->order < 0) return -1;
+
+    /* smallest order that fits the request */
+    for (k = BUDDY_MIN_ORDER; k < b->order && (1 << k) < size; k++)
+        ;
+    if ((1 << k) < size) return -1;
+
+    o = k - BUDDY_MIN_ORDER;
+    if (BUDDY_MAG_SIZE > 0 && o < BUDDY_MAG_ORDERS) {
+        m = &b->mags[buddy_cpu()];
+        block(&m->lock);
+        if (m->count[o] > 0) {
+            idx = m->blocks[o][--m->count[o]];
+            b->blocks[idx >> BUDDY_MIN_ORDER] = k + 1;
+            m->allocs++;
+            bunlock(&m->lock);
+            return idx;
+        }
+        bunlock(&m->lock);
+    }
 
-    /* if this node is a split then recurse down the
-     * left side. If the left side is not successful
-     * then try the right side.
-     */
-    if (n->state == SPLIT) {
+    block(&b->lock);
+    idx = _buddy_alloc(b, k);
+    bunlock(&b->lock);
 
-        rt = _buddy_alloc(n->left, size);
-        if (rt >= 0) return rt;
+    if (idx < 0 && BUDDY_MAG_SIZE > 0 && mag_drain(b) > 0) {
+        block(&b->lock);
+        idx = _buddy_alloc(b, k);
+        bunlock(&b->lock);
+    }
 
-        return _buddy_alloc(n->right, size);
+    if (idx < 0) {
+        block(&b->lock);
+        b->stats.failures++;
+        bunlock(&b->lock);
     }
 
-    /* if were not free return error */
-    if (n->state != FREE) return -1;
+    return idx;
+}
 
-    /* if were too small return error */
-    if (n->size < size) return -1;
+/*
+ * Attempt to allocate a page of size 'size'
+ * starting at a multiple of 'align', which has
+ * to be a power of 2. Pages are aligned to
+ * their size so asking for at least 'align'
+ * bytes is all it takes.
+ */
+int buddy_pool_alloc_align(buddy_t *b, int size, int align)
+{
+    if (align <= 0 || (align & (align - 1))) return -1;
+    return buddy_pool_alloc(b, size > align ? size : align);
+}
+
+/*
+ * Attempt to allocate a page of size 'size' out
+ * of the tree, but only if it would start below
+ * 'limit'. Returns the page's index or -1. The
+ * magazines are left alone, a block in one could
+ * be anywhere and this is about where it goes.
+ *
+ * The tree always hands out the leftmost block
+ * that fits, so it is enough to walk down to it
+ * first and see where it is.
+ */
+int buddy_pool_alloc_below(buddy_t *b, int size, int limit)
+{
+    int i = 0, idx = 0;
+    int k, order;
 
-    /* check if we have enough space to make a split */
-    if (n->size / 2 >= size) {
+    if (size <= 0 || b->order < 0) return -1;
 
-        /* we do, mark this node as SPLIT */
-        n->state = SPLIT;
+    for (k = BUDDY_MIN_ORDER; k < b->order && (1 << k) < size; k++)
+        ;
+    if ((1 << k) < size) return -1;
 
-        /* make two new nodes below us with half our size */
-        n->left = (node_t*)bmalloc(sizeof(node_t));
-        n->right = (node_t*)bmalloc(sizeof(node_t));
-        n->left->state = FREE;
-        n->right->state = FREE;
-        n->left->size = n->size / 2;
-        n->right->size = n->size / 2;
-        n->left->idx = n->idx;
-        n->right->idx = n->idx + (n->size / 2);
-        n->left->left = NULL;
-        n->right->right = NULL;
+    block(&b->lock);
 
-        /* keep traversing down the tree */
-        return _buddy_alloc(n->left, size);
+    if (b->tree[0].longest < k + 1) {
+        bunlock(&b->lock);
+        return -1;
+    }
 
+    /* a free block bigger than the page would be split with the page at its start */
+    for (order = b->order; order > k && b->tree[i].state != FREE; order--) {
+        if (b->tree[LEFT(i)].longest >= k + 1) {
+            i = LEFT(i);
+        } else {
+            i = RIGHT(i);
+            idx += 1 << (order - 1);
+        }
     }
 
-    /* if we've gotten here we are free but not big enough to split */
-    n->state = ALLOC;
-    return n->idx;
+    idx = idx < limit ? _buddy_alloc(b, k) : -1;
+    bunlock(&b->lock);
+
+    return idx;
+}
+
+/*
+ * Give every block cached in the magazines back
+ * to the tree so it can merge with its buddies.
+ * Returns how many there were.
+ */
+int buddy_pool_drain(buddy_t *b)
+{
+    return BUDDY_MAG_SIZE > 0 && b->order >= 0 ? mag_drain(b) : 0;
 }
 
 /*
@@ -93,46 +366,149 @@ int _buddy_alloc(node_t *n, int size)
  * are buddies and both free. Returns 0
  * if 'idx' was marked FREE or -1 if 'idx'
  * was not found.
+ *
+ * Small pages go into this CPU's magazine
+ * instead, if it is full the older half of
+ * it goes back into the tree.
  */
-int _buddy_free(node_t *n, int idx)
+int buddy_pool_free(buddy_t *b, int idx)
 {
-    int rt_left = -1;
-    int rt_right = -1;
+    magazine_t *m;
+    unsigned char e;
+    int o;
+
+    if (b->order < 0 || idx < 0 || idx >= (1 << b->order)) return -1;
+    if (idx & ((1 << BUDDY_MIN_ORDER) - 1)) return -1;
+
+    /* only the start of an allocated page can be freed */
+    e = b->blocks[idx >> BUDDY_MIN_ORDER];
+    if ((e & BLOCK_ORDER) == 0 || (e & BLOCK_CACHED)) return -1;
+    if (idx & ((1 << ((e & BLOCK_ORDER) - 1)) - 1)) return -1;
+
+    o = (e & BLOCK_ORDER) - 1 - BUDDY_MIN_ORDER;
+    if (BUDDY_MAG_SIZE > 0 && o < BUDDY_MAG_ORDERS) {
+
+        /* if somebody freed it at the same time they win */
+        if (!bcas(&b->blocks[idx >> BUDDY_MIN_ORDER], e, e | BLOCK_CACHED)) return -1;
+
+        m = &b->mags[buddy_cpu()];
+        block(&m->lock);
+        if (m->count[o] == BUDDY_MAG_SIZE)
+            mag_flush(b, m, o, (BUDDY_MAG_SIZE + 1) / 2);
+        m->blocks[o][m->count[o]++] = idx;
+        m->frees++;
+        bunlock(&m->lock);
+        return 0;
+    }
 
-    /* if this node is split we want to recurse down each path */
-    if (n->state == SPLIT) {
-
-        /* recurse down each path */
-        rt_left = _buddy_free(n->left, idx);
-        rt_right = _buddy_free(n->right, idx);
-
-        /* check if we should merge this split */
-        if (n->left->state == FREE && n->right->state == FREE) {
-            bfree(n->left);
-            bfree(n->right);
-            n->left = NULL;
-            n->right = NULL;
-            n->state = FREE;
+    block(&b->lock);
+    if (b->blocks[idx >> BUDDY_MIN_ORDER] != e) {
+        bunlock(&b->lock);
+        return -1;
+    }
+    _buddy_free(b, idx, o + BUDDY_MIN_ORDER);
+    b->stats.frees++;
+    bunlock(&b->lock);
+
+    return 0;
+}
+
+/*
+ * Turn the page of order 'order' at 'idx' into one
+ * of order 'k' at the same index. Shrinking gives
+ * the upper halves back to the tree, growing takes
+ * over the buddies above it. Returns -1 if one of
+ * those buddies isn't entirely free. Called with
+ * the tree locked.
+ */
+static int _buddy_resize(buddy_t *b, int idx, int order, int k)
+{
+    int i = NODE(b, idx, order);
+    int o;
+
+    if (k < order) {
+        /* keep the left half, free the right one, until we are small enough */
+        for (o = order; o > k; o--) {
+            b->tree[i].state = SPLIT;
+            b->tree[RIGHT(i)].state = FREE;
+            b->tree[RIGHT(i)].longest = o;
+            b->stats.free[o - 1]++;
+            b->stats.splits++;
+            i = LEFT(i);
         }
+        memset(&b->blocks[(idx + (1 << k)) >> BUDDY_MIN_ORDER], 0,
+               ((1 << order) - (1 << k)) >> BUDDY_MIN_ORDER);
+    } else {
+        /* we have to be the left half all the way up, with free right halves */
+        if (idx & ((1 << k) - 1)) return -1;
+        for (o = order; o < k; o++, i = PARENT(i))
+            if (b->tree[i + 1].state != FREE) return -1;
+
+        for (o = order; o < k; o++)
+            b->stats.free[o]--;
+    }
 
-        /* if either path freed the page return success */
-        if (rt_left == 0 || rt_right == 0) return 0;
+    b->tree[i].state = ALLOC;
+    b->tree[i].longest = 0;
+    b->stats.allocated += (1L << k) - (1L << order);
+    memset(&b->blocks[idx >> BUDDY_MIN_ORDER], k + 1, 1 << (k - BUDDY_MIN_ORDER));
 
-        /* neither path freed the page */
-        return -1;
+    while (i > 0) {
+        i = PARENT(i);
+        b->tree[i].longest = MAX(b->tree[LEFT(i)].longest, b->tree[RIGHT(i)].longest);
     }
 
+    return 0;
+}
 
-    /* if this nodes index matches the one were searching
-     * for and it is allocated mark it as FREE.
-     */
-    if (n->idx == idx && n->state == ALLOC) {
-        n->state = FREE;
-        return 0;
+/*
+ * Attempt to resize page 'idx' to 'size' bytes.
+ * Returns the page's index, which is 'idx' if it
+ * could be shrunk or grown in place, or -1 if
+ * 'idx' is not a page or there is no room. The
+ * old page is left alone if it fails.
+ *
+ * If the page can't grow in place a new one is
+ * allocated, the old contents are copied over
+ * and the old page is freed.
+ */
+int buddy_pool_realloc(buddy_t *b, int idx, int size)
+{
+    unsigned char e;
+    int k, order, moved;
+
+    if (size <= 0 || b->order < 0 || idx < 0 || idx >= (1 << b->order)) return -1;
+
+    /* same checks as freeing it */
+    e = b->blocks[idx >> BUDDY_MIN_ORDER];
+    if ((e & BLOCK_ORDER) == 0 || (e & BLOCK_CACHED)) return -1;
+    order = (e & BLOCK_ORDER) - 1;
+    if (idx & ((1 << order) - 1)) return -1;
+
+    /* smallest order that fits the request */
+    for (k = BUDDY_MIN_ORDER; k < b->order && (1 << k) < size; k++)
+        ;
+    if ((1 << k) < size) return -1;
+
+    block(&b->lock);
+    if (b->blocks[idx >> BUDDY_MIN_ORDER] != e) {
+        bunlock(&b->lock);
+        return -1;
+    }
+    if (k == order || _buddy_resize(b, idx, order, k) == 0) {
+        bunlock(&b->lock);
+        return idx;
     }
+    bunlock(&b->lock);
+
+    /* no room to grow here, move it somewhere there is */
+    moved = buddy_pool_alloc(b, size);
+    if (moved < 0) return -1;
+
+    memcpy(b->pool + moved, b->pool + idx, 1 << order);
+    buddy_pool_free(b, idx);
 
-    /* this is not the node we are looking for */
-    return -1;
+    return moved;
 }
 
 /*
@@ -140,84 +516,154 @@ int _buddy_free(node_t *n, int idx)
  * the end of the page containing 'idx'. Ex. if
  * page starts at idx 0 and is 10 bytes long passing
  * 7 to this function will return 3.
+ *
+ * Only looks at the block map, so it doesn't take
+ * the lock. The answer for a page that is being
+ * freed at the same time can be either.
  */
-int _buddy_size(node_t *n, int idx)
+int buddy_pool_size(buddy_t *b, int idx)
 {
-    int rt = -1;
+    int order, start;
 
-    /* if this node is a split then recurse down the
-     * right side first. If the right side is not successful
-     * then try the left side. Right side first because will
-     * have higher idx values first.
-     */
-    if (n->state == SPLIT) {
-        rt = _buddy_size(n->right, idx);
-        if (rt < 0)
-            return _buddy_size(n->left, idx);
-        else
-            return rt;
-    }
+    if (b->order < 0 || idx < 0 || idx >= (1 << b->order)) return -1;
 
-    /* if the index we're searching for is to the right
-     * of this node and to the left of the end of it and
-     * this node is allocated return the distance to the end.
-     */
-    if ((idx >= n->idx) &&
-        (idx < n->idx + n->size) &&
-        (n->state == ALLOC))
-    {
-        return (n->idx + n->size) - idx;
-    }
+    order = (b->blocks[idx >> BUDDY_MIN_ORDER] & BLOCK_ORDER) - 1;
+    if (order < 0) return -1;
 
-    /* this is not the node we are looking for */
-    return -1;
+    start = idx & ~((1 << order) - 1);
+    if (b->blocks[start >> BUDDY_MIN_ORDER] & BLOCK_CACHED) return -1;
+
+    return start + (1 << order) - idx;
 }
 
 /*
- * Walks down the whole tree and frees every node.
+ * Size of the biggest page that can currently
+ * be allocated out of the tree, 0 if the pool
+ * is full. Lets a caller shrink a request
+ * instead of retrying, or skip a full pool.
+ * Only reads the root so it doesn't take the
+ * lock, it could be out of date by the time
+ * it returns anyway.
  */
-void _buddy_kill(node_t *n)
+int buddy_pool_largest(buddy_t *b)
 {
-    /* if this node is split we want to recurse down each path */
-    if (n->state == SPLIT) {
-        _buddy_kill(n->left);
-        _buddy_kill(n->right);
+    int longest;
+
+    if (b->order < 0) return 0;
+
+    longest = ((volatile node_t*)b->tree)[0].longest;
+    return longest ? 1 << (longest - 1) : 0;
+}
+
+/*
+ * Copy the pool's counters into 'st'. Pages in
+ * magazines count as cached, not allocated, and
+ * the magazines' own allocs and frees are added
+ * in.
+ */
+void buddy_pool_stats(buddy_t *b, buddy_stats_t *st)
+{
+    magazine_t *m;
+    int i, o;
+
+    block(&b->lock);
+    *st = b->stats;
+    st->largest = b->order < 0 || !b->tree[0].longest ? 0 : 1L << (b->tree[0].longest - 1);
+    bunlock(&b->lock);
+
+    for (i = 0; i < BUDDY_NR_MAGS; i++) {
+        m = &b->mags[i];
+        block(&m->lock);
+        for (o = 0; o < BUDDY_MAG_ORDERS; o++)
+            st->cached += (long)m->count[o] << (o + BUDDY_MIN_ORDER);
+        st->allocs += m->allocs;
+        st->frees += m->frees;
+        bunlock(&m->lock);
     }
 
-    /* free ourself */
-    bfree(n);
+    st->allocated -= st->cached;
 }
 
 /*
  * Walk the tree and draw all allocated
  * and free space. If the space is allocated
  * it's index value is displayed. If space is
- * free a dash (-) is displayed.
+ * free (or cached) a dash (-) is displayed.
  */
-void _buddy_print(node_t *n)
+static void _buddy_print(buddy_t *b, int i, int order, int start)
 {
-    int i;
+    int j, used;
 
     /* if this node is split we want to recurse down each path */
-    if (n->state == SPLIT) {
-        _buddy_print(n->left);
-        _buddy_print(n->right);
+    if (b->tree[i].state == SPLIT) {
+        _buddy_print(b, LEFT(i), order - 1, start);
+        _buddy_print(b, RIGHT(i), order - 1, start + (1 << (order - 1)));
         return;
     }
 
+    used = b->tree[i].state == ALLOC &&
+           !(b->blocks[start >> BUDDY_MIN_ORDER] & BLOCK_CACHED);
+
     /* this node is either ALLOC or FREE so draw it */
-    for (i = 0; i < n->size; i++) {
-        if (n->state == FREE)
+    for (j = 0; j < (1 << order); j++) {
+        if (!used)
             printb("-,");
         else
-            printb("%d,", n->idx);
+            printb("%d,", start);
     }
     printb("|");
 }
 
-/* recursion wrappers */
-int buddy_alloc(int size) { return _buddy_alloc(buddy_head, size); }
-int buddy_free(int idx) { return _buddy_free(buddy_head, idx); }
-int buddy_size(int idx) { return _buddy_size(buddy_head, idx); }
-void buddy_print(void) { _buddy_print(buddy_head); }
-void buddy_kill(void) { _buddy_kill(buddy_head); }
+void buddy_pool_print(buddy_t *b)
+{
+    if (b->order < 0) {
+        printb("|");
+        return;
+    }
+
+    block(&b->lock);
+    _buddy_print(b, 0, b->order, 0);
+    bunlock(&b->lock);
+}
+
+/*
+ * Frees the pool, the tree and the block map.
+ * Nobody may be using the pool anymore.
+ */
+void buddy_destroy(buddy_t *b)
+{
+    if (!b) return;
+    if (b->blocks) bfree(b->blocks);
+    if (b->tree) bfree(b->tree);
+    if (b->pool) bfree(b->pool);
+    bfree(b);
+}
+
+/*
+ * The original single pool interface, all of
+ * it goes to one default pool.
+ */
+int buddy_init(int size)
+{
+    buddy_default = buddy_create(size);
+    if (!buddy_default) return -1;
+
+    buddy_pool = buddy_default->pool;
+    return 0;
+}
+
+int buddy_alloc(int size) { return buddy_pool_alloc(buddy_default, size); }
+int buddy_alloc_align(int size, int align) { return buddy_pool_alloc_align(buddy_default, size, align); }
+int buddy_free(int idx) { return buddy_pool_free(buddy_default, idx); }
+int buddy_realloc(int idx, int size) { return buddy_pool_realloc(buddy_default, idx, size); }
+int buddy_size(int idx) { return buddy_pool_size(buddy_default, idx); }
+int buddy_largest(void) { return buddy_pool_largest(buddy_default); }
+void buddy_stats(buddy_stats_t *st) { buddy_pool_stats(buddy_default, st); }
+void buddy_print(void) { buddy_pool_print(buddy_default); }
+
+void buddy_kill(void)
+{
+    buddy_destroy(buddy_default);
+    buddy_default = NULL;
+    buddy_pool = NULL;
+}
@@ -9,36 +9,161 @@
 #ifdef NONKERNEL
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #define bmalloc(...) malloc(__VA_ARGS__)
+#define bmalloc_node(size, node) malloc(size)
+/* page aligned so it can stand in for a mapped pool */
+#define bmalloc_pool(size, node) aligned_alloc(4096, ((size) + 4095) & ~4095)
 #define bfree(...) free(__VA_ARGS__)
 #define printb(...) printf(__VA_ARGS__)
+#define block_t pthread_mutex_t
+#define block_init(l) pthread_mutex_init(l, NULL)
+#define block(l) pthread_mutex_lock(l)
+#define bunlock(l) pthread_mutex_unlock(l)
+#define bcas(p, old, new) __sync_bool_compare_and_swap(p, old, new)
 #else
 #include <linux/vmalloc.h>
+#include <linux/string.h>
+#include <linux/mutex.h>
+#include <linux/smp.h>
 #define bmalloc(...) vmalloc(__VA_ARGS__)
+#define bmalloc_node(size, node) vmalloc_node(size, node)
+/* only vmalloc_user memory can be mmapped, and it has no node version */
+#define bmalloc_pool(size, node) ((node) < 0 ? vmalloc_user(size) : vmalloc_node(size, node))
 #define bfree(...) vfree(__VA_ARGS__)
 #define printb(...) printk(KERN_INFO __VA_ARGS__)
+#define block_t struct mutex
+#define block_init(l) mutex_init(l)
+#define block(l) mutex_lock(l)
+#define bunlock(l) mutex_unlock(l)
+#define bcas(p, old, new) (cmpxchg(p, old, new) == (old))
 #endif
 
+/*
+ * Smallest block handed out is 2^BUDDY_MIN_ORDER bytes. In userspace we
+ * go all the way down to single bytes so the tests can draw tiny pools,
+ * in the kernel that would make the tree bigger than the pool.
+ */
+#ifndef BUDDY_MIN_ORDER
+#ifdef NONKERNEL
+#define BUDDY_MIN_ORDER 0
+#else
+#define BUDDY_MIN_ORDER 4
+#endif
+#endif
+
+/* biggest pool is 2^BUDDY_MAX_ORDER bytes */
+#define BUDDY_MAX_ORDER 30
+
+/*
+ * Freed blocks of the BUDDY_MAG_ORDERS smallest orders are kept in per-CPU
+ * (per-thread in userspace) magazines of up to BUDDY_MAG_SIZE blocks each
+ * and handed right back out without touching the tree. In userspace this
+ * is off by default so the tests see the same placement as always.
+ */
+#ifndef BUDDY_MAG_SIZE
+#ifdef NONKERNEL
+#define BUDDY_MAG_SIZE 0
+#else
+#define BUDDY_MAG_SIZE 16
+#endif
+#endif
+
+#define BUDDY_MAG_ORDERS 4
+#define BUDDY_NR_MAGS 64
+
 /* Node can only be in one of 3 states */
 enum node_state {FREE, SPLIT, ALLOC};
 
 typedef struct node_t node_t;
 
+/*
+ * The tree lives in one array, heap ordered: the children of node i are
+ * 2i+1 and 2i+2 and every level down has blocks half the size. Since a
+ * node's index and size follow from its position all it has to remember
+ * is its state and the biggest free block anywhere below it.
+ */
 struct node_t {
-    int idx;                /* index into the pool */
-    enum node_state state;  /* state of the node */
-    int size;               /* how many bytes in the pool */
-    node_t* left;           /* if split we make two buddies below us */
-    node_t* right;
+    unsigned char state : 2;    /* state of the node */
+    unsigned char longest : 6;  /* 1 + order of the biggest free block in this subtree, 0 if none */
+};
+
+typedef struct magazine_t magazine_t;
+
+/* recently freed small blocks of one CPU, a stack per order */
+struct magazine_t {
+    block_t lock;                                   /* only contended if a thread moved CPUs */
+    int count[BUDDY_MAG_ORDERS];                    /* blocks cached of each order */
+    int blocks[BUDDY_MAG_ORDERS][BUDDY_MAG_SIZE ? BUDDY_MAG_SIZE : 1];
+    long allocs;                                    /* allocations handed out of here */
+    long frees;                                     /* frees that ended up here */
+};
+
+typedef struct buddy_stats_t buddy_stats_t;
+
+/*
+ * Counters of a pool. They are kept up to date as the pool is used so
+ * reading them takes the same time no matter how big the pool is.
+ */
+struct buddy_stats_t {
+    long size;                          /* bytes in the pool */
+    long allocated;                     /* bytes in pages that are handed out */
+    long cached;                        /* bytes in freed pages sitting in magazines */
+    long largest;                       /* biggest page that can be allocated right now */
+    long free[BUDDY_MAX_ORDER + 1];     /* free blocks in the tree of each order */
+    long allocs;                        /* successful allocations */
+    long frees;                         /* successful frees */
+    long failures;                      /* allocations that didn't fit */
+    long splits;                        /* blocks split in two to allocate */
+    long merges;                        /* buddies merged back together on free */
 };
 
-/* Pool is global so it can be read and written */
+typedef struct buddy_t buddy_t;
+
+/*
+ * One pool and everything needed to hand it out. Pools are independent of
+ * each other so they can be split up by tenant, size or NUMA node without
+ * sharing a lock.
+ */
+struct buddy_t {
+    char *pool;                             /* the memory being handed out */
+    int order;                              /* pool is 2^order bytes, -1 if there is no pool */
+    node_t *tree;                           /* every node of the tree, root first */
+    unsigned char *blocks;                  /* one entry per smallest block, see buddy.c */
+    block_t lock;                           /* guards the tree and the stats */
+    buddy_stats_t stats;                    /* everything but what the magazines count */
+    magazine_t mags[BUDDY_NR_MAGS];         /* recently freed small blocks per CPU */
+};
+
+buddy_t *buddy_create(int size);
+buddy_t *buddy_create_node(int size, int node);
+void buddy_destroy(buddy_t *b);
+int buddy_pool_alloc(buddy_t *b, int size);
+int buddy_pool_alloc_align(buddy_t *b, int size, int align);
+int buddy_pool_alloc_below(buddy_t *b, int size, int limit);
+int buddy_pool_drain(buddy_t *b);
+int buddy_pool_free(buddy_t *b, int idx);
+int buddy_pool_realloc(buddy_t *b, int idx, int size);
+int buddy_pool_size(buddy_t *b, int idx);
+int buddy_pool_largest(buddy_t *b);
+void buddy_pool_stats(buddy_t *b, buddy_stats_t *st);
+void buddy_pool_print(buddy_t *b);
+
+/*
+ * The same on one default pool. The pool is global so it can be read
+ * and written.
+ */
 extern char *buddy_pool;
 
 int buddy_init(int size);
 int buddy_alloc(int size);
+int buddy_alloc_align(int size, int align);
 int buddy_free(int idx);
+int buddy_realloc(int idx, int size);
 int buddy_size(int idx);
+int buddy_largest(void);
+void buddy_stats(buddy_stats_t *st);
 void buddy_print(void);
 void buddy_kill(void);
 
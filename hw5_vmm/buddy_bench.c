@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "buddy.h"
+
+/*
+ * Replays alloc/free traces against the buddy allocator and reports
+ * how fast it went, how long single calls took and how fragmented the
+ * pool got. A trace is a text file with one operation per line:
+ *
+ *      a <id> <size>       allocate size bytes and call it id
+ *      f <id>              free what was allocated as id
+ *
+ * Without a file the built in distributions are synthesized, always
+ * from the same seed so different builds of buddy.c see the same
+ * trace. 'buddy_bench -g <dist>' writes one of them out as a file.
+ */
+
+#define POOL_SIZE   (1 << 26)
+#define OPS         1000000
+#define LIVE        4096
+
+typedef struct op_t {
+    char free;      /* 1 to free, 0 to allocate */
+    int id;         /* which allocation */
+    int size;       /* bytes to allocate */
+} op_t;
+
+typedef struct trace_t {
+    const char *name;
+    op_t *ops;
+    int n;
+    int ids;        /* biggest id + 1 */
+} trace_t;
+
+/* sizes of the built in traces */
+int small_size(unsigned int *seed)
+{
+    return 1 + rand_r(seed) % 128;
+}
+
+int mixed_size(unsigned int *seed)
+{
+    if (rand_r(seed) % 8) return 1 + rand_r(seed) % 512;
+    return 512 + rand_r(seed) % 16384;
+}
+
+int page_size(unsigned int *seed)
+{
+    return 4096 * (1 + rand_r(seed) % 8);
+}
+
+/* mostly tiny with a long tail, every doubling half as likely */
+int tail_size(unsigned int *seed)
+{
+    int order = 4;
+    while (order < 20 && rand_r(seed) % 2)
+        order++;
+    return (1 << order) + rand_r(seed) % (1 << order);
+}
+
+struct {
+    const char *name;
+    int (*size)(unsigned int*);
+} dists[] = {
+    {"small", small_size},
+    {"mixed", mixed_size},
+    {"pages", page_size},
+    {"tail", tail_size},
+};
+
+#define NR_DISTS (int)(sizeof(dists) / sizeof(dists[0]))
+
+/* random allocs and frees over LIVE slots, sizes from dists[d] */
+void synthesize(trace_t *t, int d)
+{
+    char live[LIVE] = {0};
+    unsigned int seed = 1;
+    int i, s;
+
+    t->name = dists[d].name;
+    t->n = OPS;
+    t->ids = LIVE;
+    t->ops = (op_t*)malloc(OPS * sizeof(op_t));
+
+    for (i = 0; i < OPS; i++) {
+        s = rand_r(&seed) % LIVE;
+        t->ops[i].id = s;
+        t->ops[i].free = live[s];
+        t->ops[i].size = live[s] ? 0 : dists[d].size(&seed);
+        live[s] = !live[s];
+    }
+}
+
+/* read a trace file, returns -1 if it can't be read or makes no sense */
+int load(trace_t *t, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    char line[128], c;
+    int cap = 1024, id, size;
+
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    t->name = path;
+    t->n = 0;
+    t->ids = 0;
+    t->ops = (op_t*)malloc(cap * sizeof(op_t));
+
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' || line[0] == '\n') continue;
+
+        size = 0;
+        if (sscanf(line, " %c %d %d", &c, &id, &size) < 2 || (c != 'a' && c != 'f') ||
+            id < 0 || (c == 'a' && size <= 0)) {
+            fprintf(stderr, "%s: bad line %d: %s", path, t->n + 1, line);
+            fclose(f);
+            return -1;
+        }
+
+        if (t->n == cap) {
+            cap *= 2;
+            t->ops = (op_t*)realloc(t->ops, cap * sizeof(op_t));
+        }
+        t->ops[t->n].free = c == 'f';
+        t->ops[t->n].id = id;
+        t->ops[t->n].size = size;
+        t->n++;
+        if (id >= t->ids) t->ids = id + 1;
+    }
+
+    fclose(f);
+    return 0;
+}
+
+long nsecs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+int cmp_long(const void *a, const void *b)
+{
+    long x = *(const long*)a, y = *(const long*)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Run 't' on a fresh pool of 'pool' bytes. Internal fragmentation is
+ * the part of the allocated blocks nobody asked for, external the part
+ * of the free memory that isn't in the biggest free block. Both only
+ * count once the first tenth of the trace has filled the pool up some.
+ */
+void replay(trace_t *t, int pool)
+{
+    buddy_t *b = buddy_create(pool);
+    int *idx = (int*)malloc(t->ids * sizeof(int));
+    int *asked = (int*)malloc(t->ids * sizeof(int));
+    long *lat = (long*)malloc(t->n * sizeof(long));
+    long start, total = 0, used = 0, live = 0;
+    double frag, internal = 0, external = 0;
+    int i, s, rt, n = 0, failed = 0, order, depth = 0;
+    op_t *op;
+
+    for (i = 0; i < t->ids; i++)
+        idx[i] = -1;
+
+    for (i = 0; i < t->n; i++) {
+        op = &t->ops[i];
+
+        /* frees of allocations that failed are skipped */
+        if (op->free && idx[op->id] < 0)
+            continue;
+
+        if (op->free) {
+            s = buddy_pool_size(b, idx[op->id]);
+            start = nsecs();
+            rt = buddy_pool_free(b, idx[op->id]);
+            lat[n] = nsecs() - start;
+            if (rt < 0) {
+                fprintf(stderr, "%s: free of id %d failed\n", t->name, op->id);
+                exit(1);
+            }
+            used -= s;
+            live -= asked[op->id];
+            idx[op->id] = -1;
+        } else {
+            start = nsecs();
+            rt = buddy_pool_alloc(b, op->size);
+            lat[n] = nsecs() - start;
+            if (rt < 0) {
+                total += lat[n++];
+                failed++;
+                continue;
+            }
+            idx[op->id] = rt;
+            asked[op->id] = op->size;
+            s = buddy_pool_size(b, rt);
+            used += s;
+            live += op->size;
+
+            for (order = 0; (1 << order) < s; order++)
+                ;
+            if (b->order - order > depth) depth = b->order - order;
+        }
+        total += lat[n++];
+
+        if (i < t->n / 10)
+            continue;
+        if (used) {
+            frag = 1.0 - (double)live / used;
+            if (frag > internal) internal = frag;
+        }
+        if (used < (1L << b->order)) {
+            frag = 1.0 - (double)buddy_pool_largest(b) / ((1L << b->order) - used);
+            if (frag > external) external = frag;
+        }
+    }
+
+    /* an empty trace, or one whose ops were all skipped, has no latencies */
+    if (n == 0) {
+        printf("%-8s %8d ops\n", t->name, n);
+    } else {
+        qsort(lat, n, sizeof(long), cmp_long);
+        printf("%-8s %8d ops %7.2f Mops/s  latency ns p50 %4ld p90 %4ld p99 %5ld p99.9 %6ld max %7ld\n",
+                t->name, n, total ? n * 1e3 / total : 0.0,
+                lat[n / 2], lat[n * 9 / 10], lat[n * 99 / 100],
+                lat[n * 999 / 1000], lat[n - 1]);
+    }
+    printf("%-8s peak fragmentation internal %4.1f%% external %4.1f%%  depth %d of %d  failed %d\n",
+            "", 100 * internal, 100 * external, depth, b->order - BUDDY_MIN_ORDER, failed);
+
+    free(idx);
+    free(asked);
+    free(lat);
+    buddy_destroy(b);
+}
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-p pool bytes] [trace ...]\n"
+                    "       %s -g small|mixed|pages|tail > trace\n", name, name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    trace_t t;
+    int pool = POOL_SIZE, gen = -1;
+    int i, c;
+
+    while ((c = getopt(argc, argv, "p:g:")) != -1) {
+        switch (c) {
+        case 'p':
+            pool = atoi(optarg);
+            break;
+        case 'g':
+            for (gen = 0; gen < NR_DISTS && strcmp(dists[gen].name, optarg); gen++)
+                ;
+            if (gen == NR_DISTS) usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (gen >= 0) {
+        synthesize(&t, gen);
+        for (i = 0; i < t.n; i++) {
+            if (t.ops[i].free) printf("f %d\n", t.ops[i].id);
+            else printf("a %d %d\n", t.ops[i].id, t.ops[i].size);
+        }
+        return 0;
+    }
+
+    if (optind == argc) {
+        for (i = 0; i < NR_DISTS; i++) {
+            synthesize(&t, i);
+            replay(&t, pool);
+            free(t.ops);
+        }
+        return 0;
+    }
+
+    for (i = optind; i < argc; i++) {
+        if (load(&t, argv[i]) < 0) return 1;
+        replay(&t, pool);
+        free(t.ops);
+    }
+
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "buddy.h"
+
+/*
+ * Hammers the allocator from several threads at once. Every thread
+ * keeps a set of live blocks filled with its own pattern and checks
+ * the pattern is still intact before freeing, so two threads ever
+ * getting overlapping blocks shows up as a failed assert.
+ */
+
+#define POOL_SIZE   (1 << 24)
+#define OPS         1000000
+#define LIVE        256
+
+typedef struct worker_t {
+    int id;
+    unsigned int seed;
+} worker_t;
+
+void *worker(void *arg)
+{
+    worker_t *w = (worker_t*)arg;
+    int idx[LIVE], size[LIVE];
+    int i, j, s;
+    char c;
+
+    for (i = 0; i < LIVE; i++)
+        idx[i] = -1;
+
+    for (i = 0; i < OPS; i++) {
+        s = rand_r(&w->seed) % LIVE;
+        c = (char)(w->id * LIVE + s);
+
+        if (idx[s] >= 0) {
+            for (j = 0; j < size[s]; j++)
+                assert(buddy_pool[idx[s] + j] == c);
+            assert(buddy_free(idx[s]) == 0);
+            idx[s] = -1;
+            continue;
+        }
+
+        /* mostly small blocks, sometimes a bigger one */
+        size[s] = rand_r(&w->seed) % 8 ? 1 + rand_r(&w->seed) % 128 : 1 + rand_r(&w->seed) % 4096;
+        idx[s] = buddy_alloc(size[s]);
+        if (idx[s] < 0) continue;
+
+        assert(buddy_size(idx[s]) >= size[s]);
+        memset(buddy_pool + idx[s], c, size[s]);
+    }
+
+    for (i = 0; i < LIVE; i++)
+        if (idx[i] >= 0)
+            assert(buddy_free(idx[i]) == 0);
+
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int threads[] = {1, 2, 4, 8};
+    pthread_t t[8];
+    worker_t w[8];
+    struct timeval start, end;
+    buddy_stats_t st;
+    double secs;
+    long bytes;
+    int i, n;
+
+    printf("magazine size %d\n", BUDDY_MAG_SIZE);
+    printf("threads\tMops/s\n");
+
+    for (n = 0; n < 4; n++) {
+        assert(buddy_init(POOL_SIZE) == 0);
+
+        gettimeofday(&start, NULL);
+        for (i = 0; i < threads[n]; i++) {
+            w[i].id = i;
+            w[i].seed = i + 1;
+            pthread_create(&t[i], NULL, worker, &w[i]);
+        }
+        for (i = 0; i < threads[n]; i++)
+            pthread_join(t[i], NULL);
+        gettimeofday(&end, NULL);
+
+        /* the counters add up and nothing is left allocated */
+        buddy_stats(&st);
+        assert(st.allocated == 0 && st.allocs == st.frees);
+        for (i = 0, bytes = st.cached; i <= BUDDY_MAX_ORDER; i++)
+            bytes += st.free[i] << i;
+        assert(bytes == POOL_SIZE);
+
+        /* everything went back so the whole pool is one block again */
+        assert(buddy_alloc(POOL_SIZE) == 0);
+
+        secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+        printf("%d\t%.2f\n", threads[n], threads[n] * (double)OPS / secs / 1e6);
+
+        buddy_kill();
+    }
+
+    return 0;
+}
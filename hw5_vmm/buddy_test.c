@@ -13,6 +13,16 @@ void alloc_check(int bytes, int idx)
     assert(rt == idx);
 }
 
+void align_check(int bytes, int align, int idx)
+{
+    int rt = buddy_alloc_align(bytes, align);
+    printf("ALLOCED %d BYTES ALIGNED TO %d\t|", bytes, align);
+    buddy_print();
+    if (rt < 0) printf("  <-- returned %d", rt);
+    printf("\n");
+    assert(rt == idx);
+}
+
 void free_check(int idx, int expected_rt)
 {
     int rt = buddy_free(idx);
@@ -23,6 +33,16 @@ void free_check(int idx, int expected_rt)
     assert(rt == expected_rt);
 }
 
+void realloc_check(int idx, int bytes, int expected_idx)
+{
+    int rt = buddy_realloc(idx, bytes);
+    printf("REALLOCED IDX %d TO %d BYTES\t|", idx, bytes);
+    buddy_print();
+    if (rt < 0) printf("  <-- returned %d", rt);
+    printf("\n");
+    assert(rt == expected_idx);
+}
+
 void size_check(int idx, int size)
 {
     int rt = buddy_size(idx);
@@ -30,6 +50,13 @@ void size_check(int idx, int size)
     assert(rt == size);
 }
 
+void largest_check(int size)
+{
+    int rt = buddy_largest();
+    printf("LARGEST == %d\n", rt);
+    assert(rt == size);
+}
+
 void banner(const char *s)
 {
     static int i = 1;
@@ -38,6 +65,9 @@ void banner(const char *s)
 
 int main(void)
 {
+    buddy_t *a, *b;
+    buddy_stats_t st;
+
     banner("PDF");
     buddy_init(16);
     alloc_check(2, 0);
@@ -236,6 +266,129 @@ int main(void)
     alloc_check(5, 8);
     buddy_kill();
 
+    banner("pool not power 2");
+    buddy_init(12);
+    alloc_check(8, 0);
+    alloc_check(4, -1);
+    size_check(9, -1);
+    free_check(0, 0);
+    alloc_check(4, 0);
+    alloc_check(4, 4);
+    buddy_kill();
+
+    banner("largest free");
+    buddy_init(16);
+    largest_check(16);
+    alloc_check(2, 0);
+    largest_check(8);
+    alloc_check(8, 8);
+    largest_check(4);
+    alloc_check(4, 4);
+    largest_check(2);
+    alloc_check(4, -1);
+    alloc_check(2, 2);
+    largest_check(0);
+    alloc_check(1, -1);
+    free_check(8, 0);
+    largest_check(8);
+    free_check(0, 0);
+    free_check(2, 0);
+    free_check(4, 0);
+    largest_check(16);
+    buddy_kill();
+
+    banner("two pools");
+    a = buddy_create(16);
+    b = buddy_create(8);
+    assert(buddy_pool_alloc(a, 8) == 0);
+    assert(buddy_pool_alloc(b, 8) == 0);
+    assert(buddy_pool_alloc(b, 1) == -1);
+    assert(buddy_pool_alloc(a, 4) == 8);
+    assert(buddy_pool_size(a, 9) == 3);
+    assert(buddy_pool_size(b, 9) == -1);
+    assert(buddy_pool_free(b, 0) == 0);
+    assert(buddy_pool_free(b, 0) == -1);
+    assert(buddy_pool_largest(b) == 8);
+    assert(buddy_pool_largest(a) == 4);
+    printf("POOL A\t|");
+    buddy_pool_print(a);
+    printf("\nPOOL B\t|");
+    buddy_pool_print(b);
+    printf("\n");
+    buddy_destroy(a);
+    buddy_destroy(b);
+
+    banner("alloc below");
+    a = buddy_create(16);
+    assert(buddy_pool_alloc(a, 4) == 0);
+    assert(buddy_pool_alloc(a, 4) == 4);
+    assert(buddy_pool_alloc(a, 4) == 8);
+    assert(buddy_pool_free(a, 0) == 0);
+    assert(buddy_pool_alloc_below(a, 4, 0) == -1);
+    assert(buddy_pool_alloc_below(a, 8, 16) == -1);
+    assert(buddy_pool_alloc_below(a, 3, 8) == 0);
+    assert(buddy_pool_alloc_below(a, 4, 12) == -1);
+    assert(buddy_pool_alloc_below(a, 4, 16) == 12);
+    assert(buddy_pool_largest(a) == 0);
+    assert(buddy_pool_drain(a) == 0);
+    printf("POOL\t|");
+    buddy_pool_print(a);
+    printf("\n");
+    buddy_destroy(a);
+
+    banner("stats");
+    buddy_init(16);
+    alloc_check(2, 0);
+    alloc_check(4, 4);
+    free_check(0, 0);
+    alloc_check(16, -1);
+    buddy_stats(&st);
+    printf("STATS allocated %ld largest %ld free %ld,%ld,%ld,%ld,%ld allocs %ld frees %ld failures %ld splits %ld merges %ld\n",
+            st.allocated, st.largest, st.free[0], st.free[1], st.free[2], st.free[3], st.free[4],
+            st.allocs, st.frees, st.failures, st.splits, st.merges);
+    assert(st.size == 16 && st.allocated == 4 && st.cached == 0 && st.largest == 8);
+    assert(st.free[0] == 0 && st.free[1] == 0 && st.free[2] == 1 && st.free[3] == 1 && st.free[4] == 0);
+    assert(st.allocs == 2 && st.frees == 1 && st.failures == 1 && st.splits == 3 && st.merges == 1);
+    buddy_kill();
+
+    banner("realloc");
+    buddy_init(16);
+    alloc_check(4, 0);
+    realloc_check(0, 8, 0);
+    realloc_check(0, 2, 0);
+    alloc_check(4, 4);
+    realloc_check(0, 3, 0);
+    size_check(0, 4);
+    buddy_pool[0] = 'a';
+    buddy_pool[3] = 'b';
+    realloc_check(0, 5, 8);
+    assert(buddy_pool[8] == 'a' && buddy_pool[11] == 'b');
+    size_check(0, -1);
+    size_check(8, 8);
+    realloc_check(8, 16, -1);
+    size_check(8, 8);
+    realloc_check(9, 4, -1);
+    realloc_check(8, 0, -1);
+    realloc_check(0, 4, -1);
+    free_check(8, 0);
+    free_check(4, 0);
+    buddy_stats(&st);
+    assert(st.allocated == 0 && st.free[4] == 1);
+    buddy_kill();
+
+    banner("aligned");
+    buddy_init(16);
+    alloc_check(1, 0);
+    align_check(1, 4, 4);
+    align_check(3, 8, 8);
+    align_check(1, 1, 1);
+    align_check(1, 3, -1);
+    align_check(1, 0, -1);
+    align_check(1, 32, -1);
+    size_check(4, 4);
+    size_check(8, 8);
+    buddy_kill();
+
     banner("size left test");
     buddy_init(16);
     alloc_check(8, 0);
@@ -0,0 +1,288 @@
+#include "slab.h"
+
+#define WORD_BITS   (8 * sizeof(unsigned long))
+
+/* roughly every power of 2 and the halfway point after it */
+static const int slab_sizes[SLAB_CLASSES] = {
+    16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048
+};
+
+/*
+ * Set up the size classes for pool 'b'. Returns NULL if
+ * the map of slabs could not be allocated.
+ */
+slab_alloc_t *slab_create(buddy_t *b)
+{
+    slab_alloc_t *s;
+    slab_class_t *c;
+    long entries;
+    int i;
+
+    s = (slab_alloc_t*)bmalloc(sizeof(slab_alloc_t));
+    if (!s) return NULL;
+
+    s->buddy = b;
+    s->footprint = 0;
+
+    /* one entry per smallest slab in the pool */
+    entries = b->order >= SLAB_SHIFT ? 1L << (b->order - SLAB_SHIFT) : 1;
+    s->slabs = (slab_t**)bmalloc(entries * sizeof(slab_t*));
+    if (!s->slabs) {
+        bfree(s);
+        return NULL;
+    }
+    memset(s->slabs, 0, entries * sizeof(slab_t*));
+
+    for (i = 0; i < SLAB_CLASSES; i++) {
+        c = &s->classes[i];
+        c->size = slab_sizes[i];
+        c->partial = NULL;
+        c->full = NULL;
+        c->empty = NULL;
+        block_init(&c->lock);
+
+        /* big enough for SLAB_MIN_OBJS objects, but never more than SLAB_MAX_OBJS */
+        for (c->order = SLAB_SHIFT; (1 << c->order) < SLAB_MIN_OBJS * c->size; c->order++)
+            ;
+    }
+
+    return s;
+}
+
+static void slab_push(slab_t **list, slab_t *sl)
+{
+    sl->prev = NULL;
+    sl->next = *list;
+    if (*list) (*list)->prev = sl;
+    *list = sl;
+}
+
+static void slab_unlink(slab_t **list, slab_t *sl)
+{
+    if (sl->prev) sl->prev->next = sl->next;
+    else *list = sl->next;
+    if (sl->next) sl->next->prev = sl->prev;
+}
+
+/* point the map at 'sl' (or NULL) for every bit of pool it covers */
+static void slab_map(slab_alloc_t *s, slab_class_t *c, int idx, slab_t *sl)
+{
+    int i;
+    for (i = 0; i < 1 << (c->order - SLAB_SHIFT); i++)
+        s->slabs[(idx >> SLAB_SHIFT) + i] = sl;
+}
+
+/* get a fresh slab for class 'c' out of buddy, NULL if buddy is full */
+static slab_t *slab_grow(slab_alloc_t *s, int cls)
+{
+    slab_class_t *c = &s->classes[cls];
+    slab_t *sl;
+    int idx, i;
+
+    idx = buddy_pool_alloc(s->buddy, 1 << c->order);
+    if (idx < 0) return NULL;
+
+    sl = (slab_t*)bmalloc(sizeof(slab_t));
+    if (!sl) {
+        buddy_pool_free(s->buddy, idx);
+        return NULL;
+    }
+
+    sl->idx = idx;
+    sl->cls = cls;
+    sl->used = 0;
+    sl->nobj = (1 << c->order) / c->size;
+
+    memset(sl->free, 0, sizeof(sl->free));
+    for (i = 0; i < sl->nobj; i++)
+        sl->free[i / WORD_BITS] |= 1UL << (i % WORD_BITS);
+
+    slab_map(s, c, idx, sl);
+    __sync_fetch_and_add(&s->footprint, 1 << c->order);
+
+    return sl;
+}
+
+/* give an empty slab back to buddy */
+static void slab_shrink(slab_alloc_t *s, slab_t *sl)
+{
+    slab_class_t *c = &s->classes[sl->cls];
+
+    slab_map(s, c, sl->idx, NULL);
+    buddy_pool_free(s->buddy, sl->idx);
+    __sync_fetch_and_add(&s->footprint, -(1L << c->order));
+    bfree(sl);
+}
+
+/*
+ * Allocate 'size' bytes, returns the index into the
+ * buddy pool or -1 if there is no space left. Sizes
+ * over SLAB_MAX_OBJECT come straight from buddy.
+ */
+int slab_alloc(slab_alloc_t *s, int size)
+{
+    slab_class_t *c;
+    slab_t *sl;
+    int cls, w, obj, idx;
+
+    if (size <= 0) return -1;
+
+    if (size > SLAB_MAX_OBJECT) {
+        idx = buddy_pool_alloc(s->buddy, size);
+        if (idx >= 0)
+            __sync_fetch_and_add(&s->footprint, buddy_pool_size(s->buddy, idx));
+        return idx;
+    }
+
+    /* smallest class that fits */
+    for (cls = 0; slab_sizes[cls] < size; cls++)
+        ;
+    c = &s->classes[cls];
+
+    block(&c->lock);
+
+    /* use a slab that has room, the spare empty one or a new one */
+    sl = c->partial;
+    if (!sl && c->empty) {
+        sl = c->empty;
+        c->empty = NULL;
+        slab_push(&c->partial, sl);
+    }
+    if (!sl) {
+        sl = slab_grow(s, cls);
+        if (!sl) {
+            bunlock(&c->lock);
+            return -1;
+        }
+        slab_push(&c->partial, sl);
+    }
+
+    /* lowest free object */
+    for (w = 0; sl->free[w] == 0; w++)
+        ;
+    obj = w * WORD_BITS + __builtin_ctzl(sl->free[w]);
+    sl->free[w] &= ~(1UL << (obj % WORD_BITS));
+
+    if (++sl->used == sl->nobj) {
+        slab_unlink(&c->partial, sl);
+        slab_push(&c->full, sl);
+    }
+
+    idx = sl->idx + obj * c->size;
+    bunlock(&c->lock);
+
+    return idx;
+}
+
+/*
+ * Free the object at 'idx'. Returns 0 on success
+ * or -1 if 'idx' is not the start of an object.
+ */
+int slab_free(slab_alloc_t *s, int idx)
+{
+    slab_class_t *c;
+    slab_t *sl;
+    int obj, size;
+
+    if (idx < 0 || s->buddy->order < 0 || idx >= (1 << s->buddy->order)) return -1;
+
+    /* not in a slab, so it came straight from buddy */
+    sl = s->slabs[idx >> SLAB_SHIFT];
+    if (!sl) {
+        size = buddy_pool_size(s->buddy, idx);
+        if (buddy_pool_free(s->buddy, idx) < 0) return -1;
+        __sync_fetch_and_add(&s->footprint, -(long)size);
+        return 0;
+    }
+
+    c = &s->classes[sl->cls];
+    block(&c->lock);
+
+    /* the slab could have been given back while we looked it up */
+    if (s->slabs[idx >> SLAB_SHIFT] != sl) {
+        bunlock(&c->lock);
+        return -1;
+    }
+
+    obj = (idx - sl->idx) / c->size;
+    if ((idx - sl->idx) % c->size || obj >= sl->nobj ||
+        (sl->free[obj / WORD_BITS] >> (obj % WORD_BITS)) & 1) {
+        bunlock(&c->lock);
+        return -1;
+    }
+
+    sl->free[obj / WORD_BITS] |= 1UL << (obj % WORD_BITS);
+
+    if (sl->used-- == sl->nobj) {
+        slab_unlink(&c->full, sl);
+        slab_push(&c->partial, sl);
+    }
+
+    /* keep one empty slab around, hand the rest back to buddy */
+    if (sl->used == 0) {
+        slab_unlink(&c->partial, sl);
+        if (c->empty)
+            slab_shrink(s, sl);
+        else
+            c->empty = sl;
+    }
+
+    bunlock(&c->lock);
+    return 0;
+}
+
+/*
+ * Number of bytes until the end of the object
+ * containing 'idx', or -1 if it isn't in one.
+ */
+int slab_size(slab_alloc_t *s, int idx)
+{
+    slab_class_t *c;
+    slab_t *sl;
+    int obj, rt = -1;
+
+    if (idx < 0 || s->buddy->order < 0 || idx >= (1 << s->buddy->order)) return -1;
+
+    sl = s->slabs[idx >> SLAB_SHIFT];
+    if (!sl) return buddy_pool_size(s->buddy, idx);
+
+    c = &s->classes[sl->cls];
+    block(&c->lock);
+
+    if (s->slabs[idx >> SLAB_SHIFT] == sl) {
+        obj = (idx - sl->idx) / c->size;
+        if (obj < sl->nobj && !((sl->free[obj / WORD_BITS] >> (obj % WORD_BITS)) & 1))
+            rt = sl->idx + (obj + 1) * c->size - idx;
+    }
+
+    bunlock(&c->lock);
+    return rt;
+}
+
+/*
+ * Give every slab back to buddy and free the
+ * allocator. Big objects are left alone.
+ */
+void slab_destroy(slab_alloc_t *s)
+{
+    slab_class_t *c;
+    slab_t *sl;
+    int i;
+
+    for (i = 0; i < SLAB_CLASSES; i++) {
+        c = &s->classes[i];
+        while ((sl = c->partial)) {
+            slab_unlink(&c->partial, sl);
+            slab_shrink(s, sl);
+        }
+        while ((sl = c->full)) {
+            slab_unlink(&c->full, sl);
+            slab_shrink(s, sl);
+        }
+        if (c->empty)
+            slab_shrink(s, c->empty);
+    }
+
+    bfree(s->slabs);
+    bfree(s);
+}
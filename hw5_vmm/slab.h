@@ -0,0 +1,60 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include "buddy.h"
+
+/*
+ * Small objects are carved out of buddy blocks (slabs) in fixed size
+ * classes instead of every one of them being rounded up to a power of 2.
+ * Anything bigger than the biggest class goes straight to buddy.
+ */
+
+#define SLAB_CLASSES    15
+#define SLAB_MAX_OBJECT 2048
+
+/* slabs are at least 2^SLAB_SHIFT bytes and hold at least SLAB_MIN_OBJS objects */
+#define SLAB_SHIFT      12
+#define SLAB_MIN_OBJS   8
+#define SLAB_MAX_OBJS   256
+
+#define SLAB_WORDS      (SLAB_MAX_OBJS / (8 * sizeof(unsigned long)))
+
+typedef struct slab_t slab_t;
+typedef struct slab_class_t slab_class_t;
+typedef struct slab_alloc_t slab_alloc_t;
+
+/* one buddy block cut up into objects of a single size */
+struct slab_t {
+    int idx;                            /* where the slab starts in the pool */
+    int cls;                            /* size class of its objects */
+    int used;                           /* objects handed out */
+    int nobj;                           /* objects that fit */
+    unsigned long free[SLAB_WORDS];     /* bit set for every free object */
+    slab_t *next;                       /* neighbours on the partial or full list */
+    slab_t *prev;
+};
+
+/* all of the slabs of one size */
+struct slab_class_t {
+    int size;                           /* object size */
+    int order;                          /* slabs are 2^order bytes */
+    block_t lock;                       /* guards the lists and their slabs */
+    slab_t *partial;                    /* slabs with free objects left */
+    slab_t *full;                       /* slabs with none */
+    slab_t *empty;                      /* at most one slab kept around with nothing in it */
+};
+
+struct slab_alloc_t {
+    buddy_t *buddy;                     /* where the slabs come from */
+    slab_class_t classes[SLAB_CLASSES];
+    slab_t **slabs;                     /* slab covering every 2^SLAB_SHIFT bytes of the pool, or NULL */
+    long footprint;                     /* bytes taken out of buddy, slabs and big objects */
+};
+
+slab_alloc_t *slab_create(buddy_t *b);
+void slab_destroy(slab_alloc_t *s);
+int slab_alloc(slab_alloc_t *s, int size);
+int slab_free(slab_alloc_t *s, int idx);
+int slab_size(slab_alloc_t *s, int idx);
+
+#endif
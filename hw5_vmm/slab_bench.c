@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <sys/time.h>
+#include "slab.h"
+
+/*
+ * Replays the same random mix of mostly small objects against buddy
+ * directly and against the slab layer on top of it. Reports how fast
+ * each goes and how much of what it took out of the pool is wasted,
+ * 1 - bytes asked for / bytes taken.
+ */
+
+#define POOL_SIZE   (1 << 26)
+#define OPS         4000000
+#define LIVE        65536
+
+int sizes[LIVE];
+int idx[LIVE];
+
+/* only objects under SLAB_MAX_OBJECT, mostly under 128 bytes */
+int small_size(unsigned int *seed)
+{
+    if (rand_r(seed) % 4) return 8 + rand_r(seed) % 120;
+    return 128 + rand_r(seed) % 1920;
+}
+
+/* the same with one in 16 past a page */
+int mixed_size(unsigned int *seed)
+{
+    if (rand_r(seed) % 16 == 0) return 4096 + rand_r(seed) % 4096;
+    return small_size(seed);
+}
+
+double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* run the trace, 'use_slab' picks which allocator answers it */
+void run(const char *name, int (*pick_size)(unsigned int*), int use_slab)
+{
+    buddy_t *b = buddy_create(POOL_SIZE);
+    slab_alloc_t *s = use_slab ? slab_create(b) : NULL;
+    unsigned int seed = 1;
+    long live = 0, taken = 0, footprint;
+    double frag, worst = 0, start, secs;
+    int i, j, failed = 0;
+
+    for (i = 0; i < LIVE; i++)
+        idx[i] = -1;
+
+    start = now();
+
+    for (i = 0; i < OPS; i++) {
+        j = rand_r(&seed) % LIVE;
+
+        if (idx[j] >= 0) {
+            if (use_slab) {
+                assert(slab_free(s, idx[j]) == 0);
+            } else {
+                taken -= buddy_pool_size(b, idx[j]);
+                assert(buddy_pool_free(b, idx[j]) == 0);
+            }
+            live -= sizes[j];
+            idx[j] = -1;
+            continue;
+        }
+
+        sizes[j] = pick_size(&seed);
+        if (use_slab) {
+            idx[j] = slab_alloc(s, sizes[j]);
+        } else {
+            idx[j] = buddy_pool_alloc(b, sizes[j]);
+            if (idx[j] >= 0) taken += buddy_pool_size(b, idx[j]);
+        }
+        if (idx[j] < 0) {
+            failed++;
+            continue;
+        }
+        live += sizes[j];
+
+        footprint = use_slab ? s->footprint : taken;
+        frag = 1.0 - (double)live / footprint;
+        if (i > OPS / 10 && frag > worst) worst = frag;
+    }
+
+    secs = now() - start;
+    footprint = use_slab ? s->footprint : taken;
+
+    printf("%-6s %-6s %6.2f Mops/s  live %8ld  footprint %8ld  fragmentation %4.1f%% (worst %4.1f%%)  failed %d\n",
+            name, use_slab ? "slab" : "buddy", OPS / secs / 1e6, live, footprint,
+            100.0 * (1.0 - (double)live / footprint), 100.0 * worst, failed);
+
+    if (use_slab) slab_destroy(s);
+    buddy_destroy(b);
+}
+
+int main(void)
+{
+    run("small", small_size, 0);
+    run("small", small_size, 1);
+    run("mixed", mixed_size, 0);
+    run("mixed", mixed_size, 1);
+    return 0;
+}
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "slab.h"
+
+slab_alloc_t *s;
+
+void alloc_check(int bytes, int idx)
+{
+    int rt = slab_alloc(s, bytes);
+    printf("ALLOCED %d BYTES\t== %d\tFOOTPRINT %ld\n", bytes, rt, s->footprint);
+    assert(rt == idx);
+}
+
+void free_check(int idx, int expected_rt)
+{
+    int rt = slab_free(s, idx);
+    printf("FREED IDX %d\t== %d\tFOOTPRINT %ld\n", idx, rt, s->footprint);
+    assert(rt == expected_rt);
+}
+
+void size_check(int idx, int size)
+{
+    int rt = slab_size(s, idx);
+    printf("SIZE IDX %d == %d\n", idx, rt);
+    assert(rt == size);
+}
+
+void footprint_check(long bytes)
+{
+    printf("FOOTPRINT == %ld\n", s->footprint);
+    assert(s->footprint == bytes);
+}
+
+void banner(const char *str)
+{
+    static int i = 1;
+    printf("------------ Test %d: %s ------------\n", i++, str);
+}
+
+int main(void)
+{
+    buddy_t *b;
+    int i;
+
+    b = buddy_create(1 << 16);
+
+    banner("size classes");
+    s = slab_create(b);
+    alloc_check(1, 0);
+    alloc_check(16, 16);
+    alloc_check(17, 4096);
+    alloc_check(24, 4096 + 24);
+    alloc_check(100, 8192);
+    size_check(0, 16);
+    size_check(4096 + 24, 24);
+    size_check(8192, 128);
+    size_check(8192 + 100, 28);
+    footprint_check(3 * 4096);
+    slab_destroy(s);
+    assert(buddy_pool_largest(b) == 1 << 16);
+
+    banner("free and reuse");
+    s = slab_create(b);
+    alloc_check(16, 0);
+    alloc_check(16, 16);
+    alloc_check(16, 32);
+    free_check(16, 0);
+    size_check(16, -1);
+    alloc_check(10, 16);
+    free_check(0, 0);
+    free_check(16, 0);
+    free_check(32, 0);
+    slab_destroy(s);
+
+    banner("bad frees");
+    s = slab_create(b);
+    alloc_check(48, 0);
+    free_check(1, -1);
+    free_check(48, -1);
+    free_check(-1, -1);
+    free_check(1 << 16, -1);
+    free_check(0, 0);
+    free_check(0, -1);
+    slab_destroy(s);
+
+    banner("full slab");
+    s = slab_create(b);
+    for (i = 0; i < 4096 / 16; i++)
+        assert(slab_alloc(s, 16) == i * 16);
+    footprint_check(4096);
+    alloc_check(16, 4096);
+    footprint_check(2 * 4096);
+    free_check(32, 0);
+    alloc_check(16, 32);
+    slab_destroy(s);
+
+    banner("empty slabs go back");
+    s = slab_create(b);
+    alloc_check(32, 0);
+    alloc_check(64, 4096);
+    alloc_check(64, 4096 + 64);
+    free_check(0, 0);
+    footprint_check(2 * 4096);
+    free_check(4096, 0);
+    free_check(4096 + 64, 0);
+    footprint_check(2 * 4096);
+    alloc_check(32, 0);
+    free_check(0, 0);
+    slab_destroy(s);
+    assert(buddy_pool_largest(b) == 1 << 16);
+
+    banner("big slabs");
+    s = slab_create(b);
+    alloc_check(2048, 0);
+    alloc_check(1500, 16384);
+    size_check(0, 2048);
+    size_check(2048, -1);
+    size_check(16384 + 100, 1436);
+    footprint_check(16384 + 16384);
+    slab_destroy(s);
+
+    banner("big objects");
+    s = slab_create(b);
+    alloc_check(3000, 0);
+    alloc_check(16, 4096);
+    size_check(0, 4096);
+    size_check(100, 3996);
+    footprint_check(2 * 4096);
+    free_check(0, 0);
+    free_check(0, -1);
+    footprint_check(4096);
+    alloc_check(1 << 16, -1);
+    slab_destroy(s);
+
+    banner("no space");
+    s = slab_create(b);
+    assert(slab_alloc(s, 1 << 15) == 0);
+    assert(slab_alloc(s, 1 << 14) == 1 << 15);
+    assert(slab_alloc(s, 2048) == 3 << 14);
+    alloc_check(16, -1);
+    free_check(0, 0);
+    alloc_check(16, 0);
+    slab_destroy(s);
+
+    buddy_destroy(b);
+    return 0;
+}
@@ -11,121 +11,156 @@
 #include <linux/init.h>
 #include <linux/vmalloc.h>
 #include <linux/fs.h>
-#include <asm/uaccess.h>
-#include "buddy.h"
-#include "vmm.h"
+#include <linux/mm.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/version.h>
+#include "vmm_core.h"
 
+/* the most the pool grows to by itself, more can be added with IOCTL_ADD_EXTENT */
 int pool_size = DEFAULT_POOL_SIZE;
 module_param(pool_size, int, 0);
 
-int current_idx = 0;    /* currently selected page */
-int read_size = 0;      /* how many bytes to read when read ioctl is called */
+/* what is allocated at load and the smallest step the pool grows by */
+int extent_size = DEFAULT_EXTENT_SIZE;
+module_param(extent_size, int, 0);
 
-/* ioctl callback function */
-long ioctl(struct file *file,
-           unsigned int ioctl_num,
-           unsigned long ioctl_param)
-{
-    char ch;    /* current character to or from userspace */
-    int size;   /* size of page being written to */
-    int bytes;  /* current number of bytes being read or written */
-
-    switch (ioctl_num) {
-
-        case IOCTL_ALLOC:
-
-            printk(KERN_INFO "vmm: allocating %d bytes\n", (int)ioctl_param);
-            return buddy_alloc((int)ioctl_param);
-
-        case IOCTL_FREE:
-
-            printk(KERN_INFO "vmm: freeing idx %d\n", (int)ioctl_param);
-            return buddy_free((int)ioctl_param);
-
-        case IOCTL_SET_IDX:
-
-            current_idx = (int)ioctl_param;
-            printk(KERN_INFO "vmm: setting idx to %d\n", current_idx);
-            return 0;
-
-        case IOCTL_SET_READ_SIZE:
-
-            read_size = (int)ioctl_param;
-            printk(KERN_INFO "vmm: setting read size to %d\n", read_size);
-            return 0;
-
-        case IOCTL_WRITE:
-
-            /* reset the number of bytes written */
-            bytes = 0;
-
-            /* get the page size */
-            size = buddy_size(current_idx);
+/* log every operation and byte, can be flipped in /sys/module/vmm_dev/parameters */
+module_param_named(debug, vmm_debug, int, 0644);
 
-            /* keep writing until some condition breaks us out */
-            while (1) {
-
-                /* get the next byte from userspace */
-                get_user(ch, (char*)ioctl_param+bytes);
-
-                /* if it's a null terminator we are finished writing */
-                if (ch == '\0') break;
-
-                /* if we are about to write outside the page error out */
-                if (bytes > size) {
-                    printk(KERN_INFO "vmm: writing out of allocated area\n");
-                    return -1;
-                }
-
-                /* write the byte into the pool */
-                *(buddy_pool+current_idx+bytes) = ch;
-                printk(KERN_INFO "wrote %c to %d\n", ch, current_idx+bytes);
-
-                /* go to the next byte */
-                bytes++;
-            }
-
-            printk(KERN_INFO "vmm: wrote %d bytes\n", bytes);
+/*
+ * A process forked or split a mapping, or unmapped one. The page the
+ * mapping is of is in vm_private_data.
+ */
+static void vmm_vma_open(struct vm_area_struct *vma)
+{
+    vmm_map_again(vma->vm_file->private_data, (long)vma->vm_private_data);
+}
 
-            /* return how many bytes were written */
-            return bytes;
+static void vmm_vma_close(struct vm_area_struct *vma)
+{
+    vmm_unmap(vma->vm_file->private_data, (long)vma->vm_private_data);
+}
 
-        case IOCTL_READ:
+static const struct vm_operations_struct vmm_vm_ops = {
+    .open = vmm_vma_open,
+    .close = vmm_vma_close,
+};
 
-            /* return error if trying to read more than the page size */
-            if (read_size > buddy_size(current_idx)) {
-                printk(KERN_INFO "vmm: read bigger than allocated area\n");
-                return -1;
-            }
+/*
+ * Map a page into userspace. The offset is the index of a page the file
+ * allocated with IOCTL_ALLOC_PAGES and the mapping has to fit in it.
+ * Files using handles can't map anything since their pages may move.
+ * The page can't be freed or resized until every mapping of it is gone.
+ */
+static int vmm_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    long long idx = (long long)vma->vm_pgoff << PAGE_SHIFT;
+    unsigned long len = vma->vm_end - vma->vm_start;
+    char *extent;
+    int offset, ret;
+
+    extent = vmm_map_ok(file->private_data, idx, len, &offset);
+    if (!extent) {
+        printk(KERN_INFO "vmm: mmap of a page the file doesn't have\n");
+        return -EINVAL;
+    }
 
-            /* reset the number of bytes read */
-            bytes = 0;
+    ret = remap_vmalloc_range(vma, extent, offset >> PAGE_SHIFT);
+    vmm_map_done(idx);
+    if (ret) {
+        vmm_unmap(file->private_data, idx);
+        return ret;
+    }
 
-            /* keep reading bytes until we've satisfied the request */
-            while (bytes < read_size) {
+    vma->vm_private_data = (void *)(long)idx;
+    vma->vm_ops = &vmm_vm_ops;
+    return 0;
+}
 
-                /* get byte out of pool and send it to user */
-                put_user(*(buddy_pool+current_idx+bytes), (char*)ioctl_param+bytes);
+/* ioctl callback function */
+long ioctl(struct file *file,
+           unsigned int ioctl_num,
+           unsigned long ioctl_param)
+{
+    return vmm_ioctl(file->private_data, ioctl_num, ioctl_param);
+}
 
-                /* go to the next byte */
-                bytes++;
-            }
+static int dev_open(struct inode *inode, struct file *file)
+{
+    file->private_data = vmm_open();
+    return file->private_data ? 0 : -ENOMEM;
+}
 
-            printk(KERN_INFO "vmm: read %d bytes\n", bytes);
+static int dev_release(struct inode *inode, struct file *file)
+{
+    vmm_release(file->private_data);
+    return 0;
+}
 
-            /* return how many bytes were read */
-            return bytes;
+/* file operation callbacks */
+struct file_operations file_ops = {
+    .open = dev_open,
+    .release = dev_release,
+    .unlocked_ioctl = ioctl,
+    .mmap = vmm_mmap,
+};
 
-        default: printk(KERN_INFO "vmm: unknown ioctl call\n");
+/*
+ * /proc/vmm shows the same counters as IOCTL_STATS as text. Free space
+ * that isn't in the biggest free block is reported as fragmentation.
+ */
+static int vmm_proc_show(struct seq_file *m, void *v)
+{
+    struct vmm_stats vs;
+    long long free = 0;
+    int i;
+
+    vmm_get_stats(&vs);
+
+    seq_printf(m, "extents     %lld\n", vs.extents);
+    seq_printf(m, "size        %lld\n", vs.size);
+    seq_printf(m, "allocated   %lld\n", vs.allocated);
+    seq_printf(m, "cached      %lld\n", vs.cached);
+    seq_printf(m, "largest     %lld\n", vs.largest);
+
+    for (i = 0; i < VMM_ORDERS; i++) {
+        if (!vs.free[i]) continue;
+        seq_printf(m, "free %-6d %lld\n", 1 << i, vs.free[i]);
+        free += vs.free[i] << i;
     }
 
+    seq_printf(m, "fragmentation %lld%%\n", free ? 100 - vs.largest * 100 / free : 0);
+    seq_printf(m, "allocs      %lld\n", vs.allocs);
+    seq_printf(m, "frees       %lld\n", vs.frees);
+    seq_printf(m, "failures    %lld\n", vs.failures);
+    seq_printf(m, "splits      %lld\n", vs.splits);
+    seq_printf(m, "merges      %lld\n", vs.merges);
+    seq_printf(m, "moved       %lld\n", vs.moved);
+
     return 0;
 }
 
-/* file operation callbacks */
-struct file_operations file_ops = {
-    .unlocked_ioctl = ioctl,
+static int vmm_proc_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, vmm_proc_show, NULL);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+static const struct proc_ops proc_ops = {
+    .proc_open = vmm_proc_open,
+    .proc_read = seq_read,
+    .proc_lseek = seq_lseek,
+    .proc_release = single_release,
 };
+#else
+static const struct file_operations proc_ops = {
+    .open = vmm_proc_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+#endif
 
 /* Module entry point */
 static int __init init_mod(void)
@@ -140,12 +175,16 @@ static int __init init_mod(void)
     }
 
     /* initialize the buddy pool and tree */
-    ret = buddy_init(pool_size);
+    ret = vmm_init(pool_size, extent_size);
     if (ret < 0) {
         printk(KERN_INFO "vmm: could not allocate buddy pool\n");
         return -ENOMEM;
     }
 
+    /* the stats are nice to have, we work without them */
+    if (!proc_create(DEVICE_NAME, 0444, NULL, &proc_ops))
+        printk(KERN_INFO "vmm: could not create /proc/%s\n", DEVICE_NAME);
+
     printk(KERN_INFO "vmm: Module loaded successfully (device number: %d, pool size: %d)\n", MAJOR_NUM, pool_size);
     return 0;
 }
@@ -153,7 +192,8 @@ static int __init init_mod(void)
 /* Module exit point */
 static void __exit exit_mod(void)
 {
-    buddy_kill();
+    remove_proc_entry(DEVICE_NAME, NULL);
+    vmm_exit();
     unregister_chrdev(MAJOR_NUM, DEVICE_NAME);
     printk(KERN_INFO "vmm: Module unloaded successfully\n");
 }
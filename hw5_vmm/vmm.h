@@ -4,6 +4,9 @@
 /* default pool size is (2^12)*(2^12) bytes */
 #define DEFAULT_POOL_SIZE   16777216
 
+/* the pool starts out this big and grows by at least this much */
+#define DEFAULT_EXTENT_SIZE 1048576
+
 #define MAJOR_NUM   100
 #define DEVICE_NAME "vmm"
 
@@ -13,5 +16,147 @@
 #define IOCTL_SET_READ_SIZE     _IOR(MAJOR_NUM, 4, int)
 #define IOCTL_WRITE             _IOWR(MAJOR_NUM, 5, char *)
 #define IOCTL_READ              _IOWR(MAJOR_NUM, 6, char *)
+#define IOCTL_STATS             _IOR(MAJOR_NUM, 7, struct vmm_stats *)
+#define IOCTL_REALLOC           _IOWR(MAJOR_NUM, 8, struct vmm_realloc *)
+#define IOCTL_PWRITE            _IOW(MAJOR_NUM, 9, struct vmm_rw *)
+#define IOCTL_PREAD             _IOW(MAJOR_NUM, 10, struct vmm_rw *)
+#define IOCTL_ALLOC_PAGES       _IOWR(MAJOR_NUM, 11, int)
+#define IOCTL_BATCH             _IOWR(MAJOR_NUM, 12, struct vmm_batch *)
+#define IOCTL_ADD_EXTENT        _IOWR(MAJOR_NUM, 13, int)
+#define IOCTL_FILL              _IOW(MAJOR_NUM, 14, struct vmm_range *)
+#define IOCTL_COPY              _IOW(MAJOR_NUM, 15, struct vmm_range *)
+#define IOCTL_COMPARE           _IOW(MAJOR_NUM, 16, struct vmm_range *)
+#define IOCTL_HANDLES           _IO(MAJOR_NUM, 17)
+#define IOCTL_COMPACT           _IO(MAJOR_NUM, 18)
+
+/*
+ * The pool is made of up to VMM_MAX_EXTENTS extents, each its own buddy
+ * pool of at most 2^VMM_EXTENT_SHIFT bytes. The first is made when the
+ * module is loaded and more are added as the pool fills up, until it is
+ * pool_size bytes. Those are given back once they are empty again.
+ * IOCTL_ADD_EXTENT adds one of the given size for good and returns its
+ * number. Indexes are 64 bits and extent e holds the ones from
+ * e << VMM_EXTENT_SHIFT on.
+ *
+ * The ioctls that take or return a plain int (IOCTL_ALLOC,
+ * IOCTL_ALLOC_PAGES, IOCTL_FREE, IOCTL_SET_IDX) only reach the first two
+ * extents. Everything in the others is allocated with IOCTL_BATCH and
+ * used through the structs below.
+ */
+#define VMM_EXTENT_SHIFT    30
+#define VMM_MAX_EXTENTS     64
+
+/*
+ * IOCTL_HANDLES makes the open file hand out handles instead of indexes.
+ * It has to come before the file allocates anything. Every ioctl of that
+ * file then takes and returns handles where it would indexes. A handle
+ * stays the same for as long as its page is allocated, even through
+ * IOCTL_REALLOC, so pages allocated through handles can be moved around
+ * the pool. Handles are small numbers so the int ioctls reach every
+ * extent with them. There is no arithmetic on handles, bytes inside a
+ * page are reached with the 'offset' of the structs below, and a file
+ * using handles can't mmap its pages since they may move.
+ *
+ * IOCTL_COMPACT moves every page allocated through a handle, by any
+ * file, as far down the pool as it goes so the free space above it
+ * merges back into big blocks and empty extents can be given back.
+ * Returns how many pages moved. Pages allocated through indexes stay
+ * where they are.
+ */
+
+/*
+ * What IOCTL_PWRITE and IOCTL_PREAD take. They copy 'len' bytes between
+ * 'buf' and the pool starting 'offset' bytes into the page at 'idx' and
+ * return how many were copied.
+ */
+struct vmm_rw {
+    long long idx;  /* page to read or write */
+    int offset;     /* where in the page to start */
+    int len;        /* bytes to copy */
+    char *buf;      /* userspace side of the copy */
+};
+
+/*
+ * What IOCTL_REALLOC takes. It returns 0 with the page's new index in
+ * 'idx', or an error with the page left where it was.
+ */
+struct vmm_realloc {
+    long long idx;  /* page to resize */
+    int size;       /* bytes it should have */
+};
+
+/*
+ * What IOCTL_FILL, IOCTL_COPY and IOCTL_COMPARE take. They work on 'len'
+ * bytes starting 'offset' bytes into the page at 'idx' without anything
+ * crossing over to userspace:
+ *
+ *  IOCTL_FILL sets them all to 'byte' and returns 'len'
+ *  IOCTL_COPY copies 'len' bytes from 'src_offset' bytes into page 'src'
+ *      over them, the two may overlap, and returns 'len'
+ *  IOCTL_COMPARE compares them to the ones from 'src_offset' into page
+ *      'src' and returns how many are the same before the first that
+ *      isn't, 'len' if they all are
+ *
+ * All of the bytes have to be inside their pages.
+ */
+struct vmm_range {
+    long long idx;      /* page to fill, copy to or compare */
+    int offset;         /* where in it to start */
+    int len;            /* bytes to fill, copy or compare */
+    long long src;      /* page to copy or compare from */
+    int src_offset;     /* where in it to start */
+    int byte;           /* what to fill with */
+};
+
+/* what a struct vmm_op can do, each the same as the ioctl it is named after */
+enum vmm_op_code {
+    VMM_OP_ALLOC,       /* allocate 'len' bytes */
+    VMM_OP_FREE,        /* free page 'idx' */
+    VMM_OP_SIZE,        /* bytes left in the page from 'idx' on */
+    VMM_OP_WRITE,       /* like IOCTL_PWRITE */
+    VMM_OP_READ,        /* like IOCTL_PREAD */
+};
+
+/* one operation of an IOCTL_BATCH */
+struct vmm_op {
+    int op;             /* one of vmm_op_code */
+    long long idx;      /* page to free, size, read or write */
+    int offset;         /* where in the page to read or write */
+    int len;            /* bytes to allocate, read or write */
+    char *buf;          /* userspace side of reads and writes */
+    long long result;   /* filled in with what the single ioctl would have returned */
+};
+
+/* most operations one IOCTL_BATCH takes */
+#define VMM_BATCH_MAX   256
+
+/*
+ * What IOCTL_BATCH takes. The operations are run in order, each gets its
+ * own result and a failing one doesn't stop the rest. Returns how many
+ * were run.
+ */
+struct vmm_batch {
+    int count;              /* operations in 'ops' */
+    struct vmm_op *ops;
+};
+
+/* orders of free blocks counted, enough for the biggest pool */
+#define VMM_ORDERS  31
+
+/* what IOCTL_STATS fills in for all extents together, the same counters are in /proc/vmm */
+struct vmm_stats {
+    long long size;                 /* bytes in the pool */
+    long long allocated;            /* bytes in pages that are handed out */
+    long long cached;               /* bytes in freed pages not yet back in the tree */
+    long long largest;              /* biggest page that can be allocated right now */
+    long long free[VMM_ORDERS];     /* free blocks of 2^i bytes */
+    long long allocs;               /* successful allocations */
+    long long frees;                /* successful frees */
+    long long failures;             /* allocations that didn't fit */
+    long long splits;               /* blocks split in two to allocate */
+    long long merges;               /* buddies merged back together on free */
+    long long extents;              /* extents the pool is made of */
+    long long moved;                /* pages moved by IOCTL_COMPACT */
+};
 
 #endif
@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include "vmm.h"
+
+/*
+ * Measures how fast data gets in and out of the module's pool through
+ * IOCTL_PWRITE and IOCTL_PREAD for a few request sizes, and through the
+ * old IOCTL_WRITE/IOCTL_READ pair for comparison, and how fast bytes get
+ * from one page to another with IOCTL_COPY, IOCTL_FILL or by reading them
+ * out and writing them back. Then how many small
+ * objects can be allocated, written and freed per second one ioctl at a
+ * time and in batches, and how many of each of the other ioctls can be
+ * made per second. Last how much a pool checkerboarded with small pages
+ * gets back for big ones out of IOCTL_COMPACT. Load the module with debug=0 or this mostly measures
+ * printk. Run it with LD_PRELOAD=./libvmm.so to measure vmm_core.c
+ * without the kernel in the way.
+ */
+
+#define PAGE_BYTES  (1 << 20)
+#define TOTAL       (256 << 20)
+#define OBJECTS     (1 << 20)
+#define CALLS       (1 << 20)
+#define SMALL       4096
+#define LARGE       65536
+#define MAX_SMALL   (1 << 16)
+
+double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int pwrite_mem(int fd, long long idx, int offset, char *buf, int len)
+{
+    struct vmm_rw rw = {idx, offset, len, buf};
+    return ioctl(fd, IOCTL_PWRITE, &rw);
+}
+
+int pread_mem(int fd, long long idx, int offset, char *buf, int len)
+{
+    struct vmm_rw rw = {idx, offset, len, buf};
+    return ioctl(fd, IOCTL_PREAD, &rw);
+}
+
+/* TOTAL bytes in requests of 'len' bytes, returns MB/s or -1 on error */
+double run(int fd, int idx, char *buf, int len, int write)
+{
+    double start = now();
+    long done;
+    int rt;
+
+    for (done = 0; done < TOTAL; done += len) {
+        rt = write ? pwrite_mem(fd, idx, done % PAGE_BYTES, buf, len)
+                   : pread_mem(fd, idx, done % PAGE_BYTES, buf, len);
+        if (rt != len) return -1;
+    }
+
+    return TOTAL / (now() - start) / (1 << 20);
+}
+
+/* the same through IOCTL_SET_IDX, IOCTL_WRITE and IOCTL_READ */
+double run_old(int fd, int idx, char *buf, int len, int write)
+{
+    double start = now();
+    long done;
+    int rt;
+
+    buf[len] = '\0';
+    for (done = 0; done < TOTAL / 16; done += len) {
+        if (ioctl(fd, IOCTL_SET_IDX, idx + done % PAGE_BYTES) < 0) return -1;
+        if (write) {
+            rt = ioctl(fd, IOCTL_WRITE, buf);
+        } else {
+            if (ioctl(fd, IOCTL_SET_READ_SIZE, len) < 0) return -1;
+            rt = ioctl(fd, IOCTL_READ, buf);
+        }
+        if (rt != len) return -1;
+    }
+
+    return TOTAL / 16 / (now() - start) / (1 << 20);
+}
+
+/*
+ * TOTAL bytes in requests of 'len' bytes from page 'src' to page 'dst'
+ * with IOCTL_COPY, or IOCTL_FILL of 'dst' if 'fill' is set. Returns MB/s
+ * or -1 on error.
+ */
+double run_range(int fd, int dst, int src, int len, int fill)
+{
+    struct vmm_range r = {dst, 0, len, src, 0, 'x'};
+    double start = now();
+    long done;
+
+    for (done = 0; done < TOTAL; done += len) {
+        r.offset = r.src_offset = done % PAGE_BYTES;
+        if (ioctl(fd, fill ? IOCTL_FILL : IOCTL_COPY, &r) != len) return -1;
+    }
+
+    return TOTAL / (now() - start) / (1 << 20);
+}
+
+/* the same copy read out to 'buf' and written back, returns MB/s or -1 on error */
+double run_roundtrip(int fd, int dst, int src, char *buf, int len)
+{
+    double start = now();
+    long done;
+
+    for (done = 0; done < TOTAL; done += len) {
+        if (pread_mem(fd, src, done % PAGE_BYTES, buf, len) != len) return -1;
+        if (pwrite_mem(fd, dst, done % PAGE_BYTES, buf, len) != len) return -1;
+    }
+
+    return TOTAL / (now() - start) / (1 << 20);
+}
+
+/*
+ * Allocate, write and free OBJECTS objects of 64 bytes, 'batch' at a
+ * time (at most VMM_BATCH_MAX / 2), through IOCTL_BATCH or single ioctls
+ * if 'batch' is 1. Returns operations per second or -1 on error.
+ */
+double run_objects(int fd, char *buf, int batch)
+{
+    struct vmm_op ops[VMM_BATCH_MAX];
+    struct vmm_batch b = {0, ops};
+    double start = now();
+    long long idx[VMM_BATCH_MAX];
+    long done;
+    int i;
+
+    for (done = 0; done < OBJECTS; done += batch) {
+        if (batch == 1) {
+            idx[0] = ioctl(fd, IOCTL_ALLOC, 64);
+            if (idx[0] < 0 || pwrite_mem(fd, idx[0], 0, buf, 64) != 64) return -1;
+            if (ioctl(fd, IOCTL_FREE, (int)idx[0]) < 0) return -1;
+            continue;
+        }
+
+        /* allocate them all, then write and free them all */
+        for (i = 0; i < batch; i++) {
+            ops[i].op = VMM_OP_ALLOC;
+            ops[i].len = 64;
+        }
+        b.count = batch;
+        if (ioctl(fd, IOCTL_BATCH, &b) != batch) return -1;
+
+        for (i = 0; i < batch; i++) {
+            idx[i] = ops[i].result;
+            if (idx[i] < 0) return -1;
+        }
+
+        for (i = 0; i < batch; i++) {
+            ops[2*i] = (struct vmm_op){VMM_OP_WRITE, idx[i], 0, 64, buf, 0};
+            ops[2*i+1] = (struct vmm_op){VMM_OP_FREE, idx[i], 0, 0, NULL, 0};
+        }
+        b.count = 2 * batch;
+        if (ioctl(fd, IOCTL_BATCH, &b) != b.count) return -1;
+    }
+
+    return 3.0 * OBJECTS / (now() - start);
+}
+
+/* the ioctls timed one at a time by run_ioctl */
+enum { ALLOC_FREE, ALLOC_PAGES_FREE, REALLOC, SET_IDX, STATS, PWRITE_64, PREAD_64, CALL_KINDS };
+
+const char *call_names[CALL_KINDS] = {
+    "IOCTL_ALLOC + IOCTL_FREE",
+    "IOCTL_ALLOC_PAGES + IOCTL_FREE",
+    "IOCTL_REALLOC",
+    "IOCTL_SET_IDX",
+    "IOCTL_STATS",
+    "IOCTL_PWRITE 64 bytes",
+    "IOCTL_PREAD 64 bytes",
+};
+
+/* CALLS ioctls of kind 'which' on the page at 'idx', returns ioctls/s or -1 on error */
+double run_ioctl(int fd, int idx, char *buf, int which)
+{
+    struct vmm_realloc r = {-1, 0};
+    struct vmm_stats vs;
+    double start = now();
+    long done;
+    int rt = 0, calls = 1;
+
+    for (done = 0; done < CALLS; done++) {
+        switch (which) {
+            case ALLOC_FREE:
+                rt = ioctl(fd, IOCTL_ALLOC, 64);
+                if (rt >= 0) rt = ioctl(fd, IOCTL_FREE, rt);
+                calls = 2;
+                break;
+            case ALLOC_PAGES_FREE:
+                rt = ioctl(fd, IOCTL_ALLOC_PAGES, 4096);
+                if (rt >= 0) rt = ioctl(fd, IOCTL_FREE, rt);
+                calls = 2;
+                break;
+            case REALLOC:
+                /* back and forth between two sizes, it stays put after the first */
+                if (r.idx < 0) r.idx = ioctl(fd, IOCTL_ALLOC, 64);
+                r.size = done & 1 ? 64 : 128;
+                rt = ioctl(fd, IOCTL_REALLOC, &r);
+                break;
+            case SET_IDX: rt = ioctl(fd, IOCTL_SET_IDX, idx); break;
+            case STATS: rt = ioctl(fd, IOCTL_STATS, &vs); break;
+            case PWRITE_64: rt = pwrite_mem(fd, idx, 0, buf, 64); break;
+            case PREAD_64: rt = pread_mem(fd, idx, 0, buf, 64); break;
+        }
+        if (rt < 0) return -1;
+    }
+
+    if (which == REALLOC) ioctl(fd, IOCTL_FREE, r.idx);
+    return (double)calls * CALLS / (now() - start);
+}
+
+/*
+ * Allocate up to 'tries' pages of LARGE bytes, then free them again.
+ * Returns how many could be allocated.
+ */
+int run_large(int fd, int tries)
+{
+    int idx[MAX_SMALL / 2];
+    int i, n = 0;
+
+    for (i = 0; i < tries; i++)
+        if ((idx[n] = ioctl(fd, IOCTL_ALLOC, LARGE)) >= 0)
+            n++;
+    for (i = 0; i < n; i++)
+        ioctl(fd, IOCTL_FREE, idx[i]);
+
+    return n;
+}
+
+/*
+ * Fill the pool with pages of SMALL bytes through handles, free every
+ * other one and see how many pages of LARGE bytes fit in the bytes that
+ * were freed, before and after IOCTL_COMPACT.
+ */
+void run_fragmentation(void)
+{
+    static int small[MAX_SMALL];
+    struct vmm_stats st;
+    double start, ms;
+    int fd, n, i, tries, moved;
+
+    fd = open("/dev/vmm", 0);
+    if (fd < 0 || ioctl(fd, IOCTL_HANDLES) < 0) {
+        printf("Can't use handles\n");
+        return;
+    }
+
+    for (n = 0; n < MAX_SMALL && (small[n] = ioctl(fd, IOCTL_ALLOC, SMALL)) >= 0; n++)
+        ;
+    for (i = 0; i < n; i += 2)
+        ioctl(fd, IOCTL_FREE, small[i]);
+    tries = n / 2 * SMALL / LARGE;
+
+    printf("\n%d pages of %d bytes, every other one freed\n", n, SMALL);
+    printf("\t%d byte pages\tlargest free\n", LARGE);
+
+    ioctl(fd, IOCTL_STATS, &st);
+    printf("before\t%d of %d\t%lld\n", run_large(fd, tries), tries, st.largest);
+
+    start = now();
+    moved = ioctl(fd, IOCTL_COMPACT);
+    ms = (now() - start) * 1000;
+
+    ioctl(fd, IOCTL_STATS, &st);
+    printf("after\t%d of %d\t%lld\t(IOCTL_COMPACT moved %d pages in %.1f ms)\n",
+            run_large(fd, tries), tries, st.largest, moved, ms);
+
+    close(fd);
+}
+
+int main(void)
+{
+    int sizes[] = {64, 4096, 65536, PAGE_BYTES};
+    double mbs, fill;
+    char *buf;
+    int mem, idx, dst, i;
+
+    mem = open("/dev/vmm", 0);
+    if (mem < 0) {
+        printf("Can't open device file\n");
+        exit(-1);
+    }
+
+    idx = ioctl(mem, IOCTL_ALLOC, PAGE_BYTES);
+    if (idx < 0) {
+        printf("Can't allocate %d bytes\n", PAGE_BYTES);
+        exit(-1);
+    }
+
+    buf = malloc(PAGE_BYTES + 1);
+    memset(buf, 'x', PAGE_BYTES);
+
+    /* write before reading, or the reads fill 'buf' with an empty pool */
+    printf("bytes\twrite MB/s\tread MB/s\n");
+    for (i = 0; i < 4; i++) {
+        mbs = run(mem, idx, buf, sizes[i], 1);
+        printf("%d\t%.1f\t\t%.1f\n", sizes[i], mbs, run(mem, idx, buf, sizes[i], 0));
+    }
+
+    mbs = run_old(mem, idx, buf, 4096, 1);
+    printf("4096\t%.1f\t\t%.1f\t(IOCTL_WRITE/IOCTL_READ)\n", mbs, run_old(mem, idx, buf, 4096, 0));
+
+    /* moving bytes inside the pool against taking them through userspace */
+    dst = ioctl(mem, IOCTL_ALLOC, PAGE_BYTES);
+    if (dst >= 0) {
+        printf("\nbytes\tcopy MB/s\tfill MB/s\tread+write MB/s\n");
+        for (i = 1; i < 4; i++) {
+            mbs = run_range(mem, dst, idx, sizes[i], 0);
+            fill = run_range(mem, dst, idx, sizes[i], 1);
+            printf("%d\t%.1f\t\t%.1f\t\t%.1f\n", sizes[i], mbs, fill,
+                    run_roundtrip(mem, dst, idx, buf, sizes[i]));
+        }
+        ioctl(mem, IOCTL_FREE, dst);
+    }
+
+    printf("\nbatch\tops/s (alloc, write and free 64 bytes)\n");
+    for (i = 1; i <= VMM_BATCH_MAX / 2; i *= 8)
+        printf("%d\t%.0f\n", i, run_objects(mem, buf, i));
+
+    printf("\nioctl\t\t\t\tioctls/s\n");
+    for (i = 0; i < CALL_KINDS; i++)
+        printf("%-32s%.0f\n", call_names[i], run_ioctl(mem, idx, buf, i));
+
+    ioctl(mem, IOCTL_FREE, idx);
+    free(buf);
+    close(mem);
+
+    run_fragmentation();
+
+    return 0;
+}
@@ -0,0 +1,1224 @@
+#include "vmm_core.h"
+
+/* only worth it when looking at what a client does */
+#define vlog(...) do { if (vmm_debug) printb(__VA_ARGS__); } while (0)
+
+/* extents whose indexes still fit in an int */
+#define VMM_INT_EXTENTS (1 << (31 - VMM_EXTENT_SHIFT))
+
+int vmm_debug = 0;
+
+/*
+ * One extent of the pool. The first one and the ones added with
+ * IOCTL_ADD_EXTENT stay until the module is unloaded. The ones the pool
+ * grew by itself are given back to the kernel once nothing in them is
+ * allocated any more.
+ */
+struct vmm_extent {
+    buddy_t *b;         /* NULL if the slot is empty */
+    int pinned;         /* never given back */
+    vatomic_t pages;    /* pages allocated out of it, -1 once it is being given back */
+    vatomic_t users;    /* threads looking at it, it isn't freed while there are any */
+    int dying;          /* vmm_shrink is waiting for the users to go */
+};
+
+static struct vmm_extent vmm_extents[VMM_MAX_EXTENTS];
+static block_t vmm_extent_lock;     /* taken to add or remove one */
+static long vmm_capacity;           /* bytes the pool may grow to by itself */
+static long vmm_committed;          /* bytes in all extents */
+static int vmm_step;                /* smallest extent the pool grows by */
+
+static struct vmm_file *vmm_movable;    /* files using handles, their pages can be moved */
+static block_t vmm_files_lock;          /* guards that list */
+static vatomic_t vmm_moved;             /* pages moved by IOCTL_COMPACT */
+static vwait_t vmm_users_wait;          /* vmm_shrink sleeps here for the users of an extent */
+
+/* bytes in extent 'b' */
+#define extent_bytes(b) (1L << (b)->order)
+
+/* stop holding extent 'e' */
+static void vmm_drop(int e)
+{
+    struct vmm_extent *x = &vmm_extents[e];
+
+    /* the last one out of an extent being given back wakes vmm_shrink */
+    if (vatomic_add(&x->users, -1) == 0 && vread_once(x->dying))
+        vwake(&vmm_users_wait);
+}
+
+/*
+ * Keep extent 'e' from being freed until vmm_drop. Returns it, or NULL
+ * if there is none in that slot.
+ */
+static buddy_t *vmm_hold(int e)
+{
+    struct vmm_extent *x = &vmm_extents[e];
+    buddy_t *b;
+
+    /* whoever frees it empties the slot first and then waits for us */
+    vatomic_add(&x->users, 1);
+    b = vread_once(x->b);
+    if (!b) vmm_drop(e);
+    return b;
+}
+
+/*
+ * Make an extent of 'size' bytes in the first empty slot below 'n'.
+ * Returns its number or an error. Called with vmm_extent_lock held.
+ */
+static int vmm_new_extent(int size, int n, int pinned)
+{
+    buddy_t *b;
+    int e;
+
+    for (e = 0; e < n && e < VMM_MAX_EXTENTS && vmm_extents[e].b; e++)
+        ;
+    if (e == n || e == VMM_MAX_EXTENTS)
+        return -ENOSPC;
+
+    b = buddy_create(size);
+    if (!b || b->order < 0) {
+        if (b) buddy_destroy(b);
+        return -ENOMEM;
+    }
+
+    vmm_extents[e].pinned = pinned;
+    vatomic_set(&vmm_extents[e].pages, 0);
+    vmm_committed += extent_bytes(b);
+
+    /* everything in it has to be visible before the extent is */
+    vwrite_once(vmm_extents[e].b, b);
+
+    vlog("vmm: added extent %d of %ld bytes\n", e, extent_bytes(b));
+    return e;
+}
+
+/*
+ * Make the pool's first extent of 'extent_size' bytes and let it grow up
+ * to 'pool_size' bytes. Returns -1 if the first extent couldn't be made.
+ */
+int vmm_init(int pool_size, int extent_size)
+{
+    int e;
+
+    block_init(&vmm_extent_lock);
+    block_init(&vmm_files_lock);
+    vwait_init(&vmm_users_wait);
+    vmm_capacity = pool_size;
+    vmm_step = extent_size > 0 && extent_size < pool_size ? extent_size : pool_size;
+
+    block(&vmm_extent_lock);
+    e = vmm_new_extent(vmm_step, VMM_MAX_EXTENTS, 1);
+    bunlock(&vmm_extent_lock);
+
+    return e < 0 ? -1 : 0;
+}
+
+/*
+ * Add an extent of 'size' bytes (rounded down to a power of 2, at most
+ * 2^VMM_EXTENT_SHIFT) to the pool for good. Returns its number, or an
+ * error if it couldn't be allocated or there are already VMM_MAX_EXTENTS.
+ */
+int vmm_add_extent(int size)
+{
+    int e;
+
+    if (size <= 0) return -EINVAL;
+
+    block(&vmm_extent_lock);
+    e = vmm_new_extent(size, VMM_MAX_EXTENTS, 1);
+    bunlock(&vmm_extent_lock);
+
+    return e;
+}
+
+/*
+ * Grow the pool by an extent that fits 'size' bytes, if it stays under
+ * its capacity. Returns the new extent's number or -1.
+ */
+static int vmm_grow(int size, int n)
+{
+    long bytes;
+    int e = -1;
+
+    for (bytes = vmm_step; bytes < size && bytes < (1L << VMM_EXTENT_SHIFT); bytes *= 2)
+        ;
+    if (bytes < size) return -1;
+
+    block(&vmm_extent_lock);
+    if (vmm_committed + bytes <= vmm_capacity)
+        e = vmm_new_extent(bytes, n, 0);
+    bunlock(&vmm_extent_lock);
+
+    return e < 0 ? -1 : e;
+}
+
+/*
+ * Whether extent 'e' may be given back once nothing in it is allocated:
+ * it has to have grown the pool, and one empty extent of the smallest
+ * size is kept so a pool going back and forth over an extent's edge
+ * doesn't allocate and free it every time. It only looks, so it can be
+ * asked without vmm_extent_lock, vmm_shrink asks again under it.
+ */
+static int vmm_shrinkable(int e)
+{
+    struct vmm_extent *x = &vmm_extents[e];
+    buddy_t *b;
+    int i, rt, spare;
+
+    b = vmm_hold(e);
+    if (!b) return 0;
+
+    rt = !x->pinned;
+    if (rt && extent_bytes(b) <= vmm_step) {
+        for (i = 0, spare = 0; i < VMM_MAX_EXTENTS && !spare; i++) {
+            if (i == e || !vmm_hold(i)) continue;
+            spare = !vmm_extents[i].pinned && vatomic_read(&vmm_extents[i].pages) == 0;
+            vmm_drop(i);
+        }
+        rt = spare;
+    }
+
+    vmm_drop(e);
+    return rt;
+}
+
+/* give extent 'e' back to the kernel if it may be and nothing in it is allocated */
+static void vmm_shrink(int e)
+{
+    struct vmm_extent *x = &vmm_extents[e];
+    buddy_t *b;
+
+    block(&vmm_extent_lock);
+
+    b = x->b;
+    if (!b || vatomic_read(&x->pages) || !vmm_shrinkable(e)) {
+        bunlock(&vmm_extent_lock);
+        return;
+    }
+
+    /* close it to allocations, unless one got in first */
+    if (!vatomic_cas(&x->pages, 0, -1)) {
+        bunlock(&vmm_extent_lock);
+        return;
+    }
+
+    /*
+     * nothing in it is anyone's, so only stale lookups can still have it,
+     * sleep until the last of them drops it
+     */
+    vwrite_once(x->dying, 1);
+    vwrite_once(x->b, NULL);
+    vwait_event(&vmm_users_wait, vatomic_read(&x->users) == 0);
+    vwrite_once(x->dying, 0);
+
+    vmm_committed -= extent_bytes(b);
+    buddy_destroy(b);
+    bunlock(&vmm_extent_lock);
+
+    vlog("vmm: gave back extent %d\n", e);
+}
+
+void vmm_exit(void)
+{
+    int e;
+
+    for (e = 0; e < VMM_MAX_EXTENTS; e++) {
+        if (vmm_extents[e].b)
+            buddy_destroy(vmm_extents[e].b);
+        vmm_extents[e].b = NULL;
+    }
+    vmm_committed = 0;
+}
+
+/* number of the extent holding 'idx', -1 if it can't be in one */
+static int vmm_extent_of(long long idx)
+{
+    if (idx < 0 || (idx >> VMM_EXTENT_SHIFT) >= VMM_MAX_EXTENTS)
+        return -1;
+    return idx >> VMM_EXTENT_SHIFT;
+}
+
+/* where in its extent 'idx' is */
+#define extent_offset(idx) ((int)((idx) & ((1 << VMM_EXTENT_SHIFT) - 1)))
+
+/*
+ * Hold the extent holding 'idx' like vmm_hold, with where in it 'idx'
+ * is in 'off'. Returns NULL if no extent holds it.
+ */
+static buddy_t *vmm_hold_idx(long long idx, int *off)
+{
+    int e = vmm_extent_of(idx);
+
+    if (e < 0) return NULL;
+    *off = extent_offset(idx);
+    return vmm_hold(e);
+}
+
+/* bytes from 'idx' to the end of its page, -1 if it isn't in one */
+static int vmm_size(long long idx)
+{
+    buddy_t *b;
+    int off, rt;
+
+    b = vmm_hold_idx(idx, &off);
+    if (!b) return -1;
+
+    rt = buddy_pool_size(b, off);
+    vmm_drop(idx >> VMM_EXTENT_SHIFT);
+    return rt;
+}
+
+/* count a page against extent 'e' before taking it so it can't be given back under us */
+static int vmm_reserve(int e)
+{
+    struct vmm_extent *x = &vmm_extents[e];
+    long pages;
+
+    do {
+        pages = vatomic_read(&x->pages);
+        if (pages < 0) return -1;
+    } while (!vatomic_cas(&x->pages, pages, pages + 1));
+
+    return 0;
+}
+
+/*
+ * Stop counting a page against extent 'e', giving it back if that was
+ * the last. Extents that stay anyway never take vmm_extent_lock.
+ */
+static void vmm_unreserve(int e)
+{
+    if (vatomic_add(&vmm_extents[e].pages, -1) == 0 && vmm_shrinkable(e))
+        vmm_shrink(e);
+}
+
+/*
+ * Allocate out of extent 'e', returns the page's index or -1. Unless
+ * 'hard' is set extents whose tree has no block big enough are skipped
+ * without emptying their magazines to look for one.
+ */
+static long long vmm_get_from(int e, int size, int align, int hard)
+{
+    buddy_t *b;
+    int idx;
+
+    b = vmm_hold(e);
+    if (!b) return -1;
+
+    if ((!hard && buddy_pool_largest(b) < (size > align ? size : align)) || vmm_reserve(e) < 0) {
+        vmm_drop(e);
+        return -1;
+    }
+
+    idx = align ? buddy_pool_alloc_align(b, size, align) : buddy_pool_alloc(b, size);
+    vmm_drop(e);
+
+    if (idx < 0) {
+        vmm_unreserve(e);
+        return -1;
+    }
+
+    return ((long long)e << VMM_EXTENT_SHIFT) + idx;
+}
+
+/*
+ * Allocate out of the first of the first 'n' extents that has room,
+ * growing the pool if none has. Returns the page's index or -1.
+ */
+static long long vmm_get(int size, int align, int n)
+{
+    long long idx;
+    int e;
+
+    for (e = 0; e < n && e < VMM_MAX_EXTENTS; e++)
+        if ((idx = vmm_get_from(e, size, align, 0)) >= 0)
+            return idx;
+
+    /* what the magazines hold might do before growing */
+    for (e = 0; e < n && e < VMM_MAX_EXTENTS; e++)
+        if ((idx = vmm_get_from(e, size, align, 1)) >= 0)
+            return idx;
+
+    e = vmm_grow(size > align ? size : align, n);
+    return e < 0 ? -1 : vmm_get_from(e, size, align, 1);
+}
+
+static int vmm_put(long long idx)
+{
+    buddy_t *b;
+    int off, rt, e;
+
+    b = vmm_hold_idx(idx, &off);
+    if (!b) return -1;
+
+    e = idx >> VMM_EXTENT_SHIFT;
+    rt = buddy_pool_free(b, off);
+    vmm_drop(e);
+
+    if (rt == 0)
+        vmm_unreserve(e);
+
+    return rt;
+}
+
+/*
+ * Resize the page at 'idx' in its own extent if it fits there, or move
+ * it to any other extent with room. Returns the new index or -1 with
+ * the page left alone.
+ */
+static long long vmm_move(long long idx, int size)
+{
+    long long to;
+    buddy_t *b, *tb;
+    int off, rt, old;
+
+    b = vmm_hold_idx(idx, &off);
+    if (!b) return -1;
+
+    rt = buddy_pool_realloc(b, off, size);
+    old = buddy_pool_size(b, off);
+    vmm_drop(idx >> VMM_EXTENT_SHIFT);
+
+    if (rt >= 0)
+        return idx - off + rt;
+    if (old < 0 || size <= 0)
+        return -1;
+
+    /* the page is ours so its extent can't go away while we copy it */
+    to = vmm_get(size, 0, VMM_MAX_EXTENTS);
+    if (to < 0) return -1;
+
+    tb = vmm_hold(to >> VMM_EXTENT_SHIFT);
+    b = vmm_hold(idx >> VMM_EXTENT_SHIFT);
+    memcpy(tb->pool + extent_offset(to), b->pool + off, old < size ? old : size);
+    vmm_drop(idx >> VMM_EXTENT_SHIFT);
+    vmm_drop(to >> VMM_EXTENT_SHIFT);
+
+    vmm_put(idx);
+    return to;
+}
+
+/* every open gets its own selected page and read size */
+struct vmm_file *vmm_open(void)
+{
+    struct vmm_file *f = vmm_zalloc(sizeof(struct vmm_file));
+
+    if (f) {
+        block_init(&f->lock);
+        block_init(&f->move_lock);
+        f->free_handle = -1;
+    }
+    return f;
+}
+
+/* free every page the file still owns, one pass over its table */
+void vmm_release(struct vmm_file *f)
+{
+    struct vmm_file **p;
+    int i;
+
+    /* out of IOCTL_COMPACT's way before the pages go */
+    if (f->nhandles) {
+        block(&vmm_files_lock);
+        for (p = &vmm_movable; *p != f; p = &(*p)->next)
+            ;
+        *p = f->next;
+        bunlock(&vmm_files_lock);
+    }
+
+    if (f->nowned)
+        vlog("vmm: freeing %d pages left by a closed file\n", f->nowned);
+
+    for (i = 0; i < f->slots; i++)
+        if (f->owned[i] >= 0)
+            vmm_put(f->owned[i]);
+
+    vmm_free(f->owned);
+    vmm_free(f->handles);
+    vmm_free(f->maps);
+    vmm_free(f);
+}
+
+/* where 'idx' is in the file's table, or the empty slot it would go in */
+static int vmm_slot(struct vmm_file *f, long long idx)
+{
+    unsigned int i = ((unsigned long long)idx >> BUDDY_MIN_ORDER) * 0x9e3779b97f4a7c15ULL >> 32;
+
+    for (i &= f->slots - 1; f->owned[i] >= 0 && f->owned[i] != idx; i = (i + 1) & (f->slots - 1))
+        ;
+    return i;
+}
+
+static int vmm_owns(struct vmm_file *f, long long idx)
+{
+    return idx >= 0 && f->nowned && f->owned[vmm_slot(f, idx)] == idx;
+}
+
+/* record 'idx' as the file's, doubling the table when it gets half full */
+static int vmm_own(struct vmm_file *f, long long idx)
+{
+    long long *old = f->owned;
+    int slots = f->slots, i;
+
+    if (2 * (f->nowned + 1) > f->slots) {
+        f->slots = slots ? 2 * slots : 16;
+        f->owned = vmm_zalloc(f->slots * sizeof(long long));
+        if (!f->owned) {
+            f->owned = old;
+            f->slots = slots;
+            return -ENOMEM;
+        }
+        memset(f->owned, -1, f->slots * sizeof(long long));
+        for (i = 0; i < slots; i++)
+            if (old[i] >= 0)
+                f->owned[vmm_slot(f, old[i])] = old[i];
+        vmm_free(old);
+    }
+
+    f->owned[vmm_slot(f, idx)] = idx;
+    f->nowned++;
+    return 0;
+}
+
+/* forget 'idx', moving back anything that was pushed past its slot */
+static void vmm_disown(struct vmm_file *f, long long idx)
+{
+    long long k;
+    int i = vmm_slot(f, idx), j;
+
+    f->owned[i] = -1;
+    f->nowned--;
+
+    for (j = (i + 1) & (f->slots - 1); f->owned[j] >= 0; j = (j + 1) & (f->slots - 1)) {
+        k = f->owned[j];
+        f->owned[j] = -1;
+        f->owned[vmm_slot(f, k)] = k;
+    }
+}
+
+/* double the file's table of handles, or start one, with the new handles all free */
+static int vmm_more_handles(struct vmm_file *f)
+{
+    long long *old = f->handles;
+    int n = f->nhandles ? 2 * f->nhandles : 16, h;
+
+    f->handles = vmm_zalloc(n * sizeof(long long));
+    if (!f->handles) {
+        f->handles = old;
+        return -ENOMEM;
+    }
+    if (old) memcpy(f->handles, old, f->nhandles * sizeof(long long));
+    vmm_free(old);
+
+    for (h = n - 1; h >= f->nhandles; h--) {
+        f->handles[h] = -2 - f->free_handle;
+        f->free_handle = h;
+    }
+    f->nhandles = n;
+    return 0;
+}
+
+/* give page 'idx' a handle, returns it or an error */
+static long long vmm_new_handle(struct vmm_file *f, long long idx)
+{
+    int h;
+
+    if (f->free_handle < 0 && vmm_more_handles(f) < 0)
+        return -ENOMEM;
+
+    h = f->free_handle;
+    f->free_handle = -2 - f->handles[h];
+    f->handles[h] = idx;
+    return h;
+}
+
+static void vmm_free_handle(struct vmm_file *f, long long h)
+{
+    f->handles[h] = -2 - f->free_handle;
+    f->free_handle = h;
+}
+
+/* the page behind handle 'h' if 'f' uses handles, 'h' itself if it doesn't, -1 if there is none */
+static long long vmm_lookup(struct vmm_file *f, long long h)
+{
+    if (!f->nhandles) return h;
+    if (h < 0 || h >= f->nhandles || f->handles[h] < 0) return -1;
+    return f->handles[h];
+}
+
+/* where page 'idx' is in the file's mapped pages, -1 if it isn't mapped */
+static int vmm_mapped(struct vmm_file *f, long long idx)
+{
+    int i;
+
+    for (i = 0; i < f->nmaps; i++)
+        if (f->maps[i].idx == idx)
+            return i;
+    return -1;
+}
+
+/* count one more mapping of page 'idx', called with f->lock held */
+static int vmm_count_map(struct vmm_file *f, long long idx)
+{
+    struct vmm_map *old = f->maps;
+    int i = vmm_mapped(f, idx), cap;
+
+    if (i < 0) {
+        if (f->nmaps == f->maps_cap) {
+            cap = f->maps_cap ? 2 * f->maps_cap : 4;
+            f->maps = vmm_zalloc(cap * sizeof(struct vmm_map));
+            if (!f->maps) {
+                f->maps = old;
+                return -ENOMEM;
+            }
+            if (old) memcpy(f->maps, old, f->nmaps * sizeof(struct vmm_map));
+            vmm_free(old);
+            f->maps_cap = cap;
+        }
+        i = f->nmaps++;
+        f->maps[i].idx = idx;
+        f->maps[i].count = 0;
+    }
+
+    f->maps[i].count++;
+    return 0;
+}
+
+/* -EBUSY if page 'idx' is mapped, it has to stay where it is until it isn't */
+static int vmm_busy(struct vmm_file *f, long long idx)
+{
+    return vmm_mapped(f, idx) >= 0 ? -EBUSY : 0;
+}
+
+/*
+ * Make 'f' hand out handles from now on, it may not have allocated
+ * anything yet. Returns 0 or an error.
+ */
+static int vmm_use_handles(struct vmm_file *f)
+{
+    int rt;
+
+    block(&f->lock);
+    if (f->nowned || f->nhandles) {
+        bunlock(&f->lock);
+        return f->nhandles ? 0 : -EBUSY;
+    }
+    rt = vmm_more_handles(f);
+    bunlock(&f->lock);
+    if (rt < 0) return rt;
+
+    /* where IOCTL_COMPACT finds pages it may move */
+    block(&vmm_files_lock);
+    f->next = vmm_movable;
+    vmm_movable = f;
+    bunlock(&vmm_files_lock);
+
+    return 0;
+}
+
+/*
+ * Allocate through 'f' out of the first 'n' extents, 'f' then owns the
+ * page. Returns its index, or its handle if 'f' uses handles.
+ */
+static long long vmm_alloc(struct vmm_file *f, int size, int align, int n)
+{
+    long long idx = vmm_get(size, align, n), h;
+
+    if (idx < 0) return idx;
+
+    block(&f->lock);
+    if (vmm_own(f, idx) < 0) {
+        vmm_put(idx);
+        idx = -ENOMEM;
+    } else if (f->nhandles) {
+        h = vmm_new_handle(f, idx);
+        if (h < 0) {
+            vmm_disown(f, idx);
+            vmm_put(idx);
+        }
+        idx = h;
+    }
+    bunlock(&f->lock);
+
+    return idx;
+}
+
+/* free a page, but only one 'f' allocated and only once it isn't mapped */
+static int vmm_release_page(struct vmm_file *f, long long h)
+{
+    long long idx = vmm_lookup(f, h);
+    int rt = -1;
+
+    block(&f->lock);
+    if (vmm_owns(f, idx) && (rt = vmm_busy(f, idx)) == 0 && (rt = vmm_put(idx)) == 0) {
+        vmm_disown(f, idx);
+        if (f->nhandles) vmm_free_handle(f, h);
+    }
+    bunlock(&f->lock);
+
+    return rt;
+}
+
+/*
+ * Resize a page 'f' owns and hasn't mapped, it keeps owning it wherever
+ * it ends up. Returns the new index, or the same handle if 'f' uses
+ * handles.
+ */
+static long long vmm_resize(struct vmm_file *f, long long h, int size)
+{
+    long long idx = vmm_lookup(f, h), rt = -1;
+
+    block(&f->lock);
+    if (vmm_owns(f, idx) && (rt = vmm_busy(f, idx)) == 0 && (rt = vmm_move(idx, size)) >= 0 && rt != idx) {
+        /* swapping one for the other never needs a bigger table */
+        vmm_disown(f, idx);
+        vmm_own(f, rt);
+    }
+    if (rt >= 0 && f->nhandles) {
+        f->handles[h] = rt;
+        rt = h;
+    }
+    bunlock(&f->lock);
+
+    return rt;
+}
+
+/* give every block cached in a magazine back to its extent's tree */
+static void vmm_drain(void)
+{
+    buddy_t *b;
+    int e;
+
+    for (e = 0; e < VMM_MAX_EXTENTS; e++) {
+        b = vmm_hold(e);
+        if (!b) continue;
+        buddy_pool_drain(b);
+        vmm_drop(e);
+    }
+}
+
+/*
+ * Move the page at 'idx' to the lowest free block of its size that is
+ * below it, in its own extent or any before it. Returns where the page
+ * is now, which is 'idx' if there was nowhere lower. Called with its
+ * owner locked so nothing else is looking at it.
+ */
+static long long vmm_lower(long long idx)
+{
+    buddy_t *b, *tb;
+    int e = idx >> VMM_EXTENT_SHIFT, off = extent_offset(idx);
+    int size, t, to = -1;
+
+    /* the page is allocated so its extent is there */
+    b = vmm_hold(e);
+    size = buddy_pool_size(b, off);
+
+    for (t = 0; t <= e; t++) {
+        tb = vmm_hold(t);
+        if (!tb) continue;
+
+        if (buddy_pool_largest(tb) < size || vmm_reserve(t) < 0) {
+            vmm_drop(t);
+            continue;
+        }
+
+        to = buddy_pool_alloc_below(tb, size, t == e ? off : extent_bytes(tb));
+        if (to >= 0)
+            memcpy(tb->pool + to, b->pool + off, size);
+        vmm_drop(t);
+
+        if (to >= 0) break;
+        vmm_unreserve(t);
+    }
+
+    vmm_drop(e);
+    if (to < 0) return idx;
+
+    vmm_put(idx);
+    return ((long long)t << VMM_EXTENT_SHIFT) + to;
+}
+
+/*
+ * Move every page a file allocated through a handle as far down the pool
+ * as it goes, again until none moves, so the free space left above it
+ * merges into big blocks and empty extents are given back. Returns how
+ * many pages moved.
+ */
+static int vmm_compact(void)
+{
+    struct vmm_file *f;
+    long long to;
+    int h, n, moved = 0;
+
+    block(&vmm_files_lock);
+    do {
+        /* blocks sitting in magazines are holes the trees can't see */
+        vmm_drain();
+
+        n = 0;
+        for (f = vmm_movable; f; f = f->next) {
+            block(&f->move_lock);
+            block(&f->lock);
+            for (h = 0; h < f->nhandles; h++) {
+                if (f->handles[h] < 0 || vmm_mapped(f, f->handles[h]) >= 0) continue;
+                to = vmm_lower(f->handles[h]);
+                if (to == f->handles[h]) continue;
+                vmm_disown(f, f->handles[h]);
+                vmm_own(f, to);
+                f->handles[h] = to;
+                n++;
+            }
+            bunlock(&f->lock);
+            bunlock(&f->move_lock);
+            vmm_relax();
+        }
+        moved += n;
+    } while (n > 0);
+    vmm_drain();
+    bunlock(&vmm_files_lock);
+
+    vatomic_add(&vmm_moved, moved);
+    return moved;
+}
+
+/* the counters of all extents added up, in the layout userspace knows */
+void vmm_get_stats(struct vmm_stats *vs)
+{
+    buddy_stats_t st;
+    buddy_t *b;
+    int e, i;
+
+    memset(vs, 0, sizeof(*vs));
+
+    for (e = 0; e < VMM_MAX_EXTENTS; e++) {
+        b = vmm_hold(e);
+        if (!b) continue;
+        buddy_pool_stats(b, &st);
+        vmm_drop(e);
+
+        vs->size += st.size;
+        vs->allocated += st.allocated;
+        vs->cached += st.cached;
+        if (st.largest > vs->largest)
+            vs->largest = st.largest;
+        for (i = 0; i < VMM_ORDERS && i <= BUDDY_MAX_ORDER; i++)
+            vs->free[i] += st.free[i];
+        vs->allocs += st.allocs;
+        vs->frees += st.frees;
+        vs->failures += st.failures;
+        vs->splits += st.splits;
+        vs->merges += st.merges;
+        vs->extents++;
+    }
+    vs->moved = vatomic_read(&vmm_moved);
+}
+
+/*
+ * Check that 'len' bytes starting 'offset' bytes into the page at 'idx'
+ * are all in that page. Returns where they start with the extent held,
+ * or NULL.
+ */
+static char *vmm_bounds(long long idx, int offset, int len)
+{
+    buddy_t *b;
+    int off, size;
+
+    b = vmm_hold_idx(idx, &off);
+    if (!b) return NULL;
+
+    size = buddy_pool_size(b, off);
+    if (size < 0 || offset < 0 || len < 0 || offset > size || len > size - offset) {
+        vmm_drop(idx >> VMM_EXTENT_SHIFT);
+        return NULL;
+    }
+
+    return b->pool + off + offset;
+}
+
+/*
+ * Copy 'len' bytes between 'buf' and the pool 'offset' bytes into the
+ * page at 'idx', into the pool if 'write' is set. Returns 'len' or an
+ * error if the bytes aren't all in the page or 'buf' is bad.
+ */
+static int vmm_copy(long long idx, int offset, int len, char *buf, int write)
+{
+    char *p;
+    int i, rt = len;
+
+    /* everything has to be inside the one page */
+    p = vmm_bounds(idx, offset, len);
+    if (!p) {
+        printb("vmm: access outside of allocated area\n");
+        return -1;
+    }
+
+    if (write ? vcopy_from_user(p, buf, len) : vcopy_to_user(buf, p, len))
+        rt = -EFAULT;
+    else if (vmm_debug)
+        for (i = 0; i < len; i++)
+            printb("%s %c at %lld\n", write ? "wrote" : "read", p[i], idx + offset + i);
+
+    vmm_drop(idx >> VMM_EXTENT_SHIFT);
+    return rt;
+}
+
+/*
+ * Fill, copy or compare the bytes 'r' points at inside the pool, for
+ * 'ioctl_num' one of IOCTL_FILL, IOCTL_COPY or IOCTL_COMPARE.
+ */
+static int vmm_range(unsigned int ioctl_num, struct vmm_range *r)
+{
+    char *to, *from = NULL;
+    int rt = r->len;
+
+    to = vmm_bounds(r->idx, r->offset, r->len);
+    if (!to) {
+        printb("vmm: access outside of allocated area\n");
+        return -1;
+    }
+
+    if (ioctl_num != IOCTL_FILL) {
+        from = vmm_bounds(r->src, r->src_offset, r->len);
+        if (!from) {
+            vmm_drop(r->idx >> VMM_EXTENT_SHIFT);
+            printb("vmm: access outside of allocated area\n");
+            return -1;
+        }
+    }
+
+    switch (ioctl_num) {
+        case IOCTL_FILL:
+            memset(to, r->byte, r->len);
+            break;
+        case IOCTL_COPY:
+            memmove(to, from, r->len);
+            break;
+        case IOCTL_COMPARE:
+            /* most compares are of equal bytes, only look for where they differ if they don't */
+            if (memcmp(to, from, r->len))
+                for (rt = 0; rt < r->len && to[rt] == from[rt]; rt++)
+                    ;
+            break;
+    }
+
+    if (from) vmm_drop(r->src >> VMM_EXTENT_SHIFT);
+    vmm_drop(r->idx >> VMM_EXTENT_SHIFT);
+    return rt;
+}
+
+/* run one operation of a batch for 'f' */
+static long long vmm_run_op(struct vmm_file *f, struct vmm_op *op)
+{
+    switch (op->op) {
+        case VMM_OP_ALLOC: return vmm_alloc(f, op->len, 0, VMM_MAX_EXTENTS);
+        case VMM_OP_FREE: return vmm_release_page(f, op->idx);
+        case VMM_OP_SIZE: return vmm_size(vmm_lookup(f, op->idx));
+        case VMM_OP_WRITE: return vmm_copy(vmm_lookup(f, op->idx), op->offset, op->len, op->buf, 1);
+        case VMM_OP_READ: return vmm_copy(vmm_lookup(f, op->idx), op->offset, op->len, op->buf, 0);
+    }
+    return -EINVAL;
+}
+
+/* every ioctl for the open file 'f', see vmm_ioctl */
+static long vmm_do_ioctl(struct vmm_file *f, unsigned int ioctl_num, unsigned long ioctl_param)
+{
+    int size;           /* size of page being written to */
+    int bytes;          /* current number of bytes being read or written */
+    long long idx;      /* page being read or written */
+    char *p;            /* where that is */
+    int i;
+
+    switch (ioctl_num) {
+
+        case IOCTL_ALLOC:
+
+            vlog("vmm: allocating %d bytes\n", (int)ioctl_param);
+            return vmm_alloc(f, (int)ioctl_param, 0, f->nhandles ? VMM_MAX_EXTENTS : VMM_INT_EXTENTS);
+
+        case IOCTL_ALLOC_PAGES:
+
+            /* page aligned and a whole number of pages so it can be mmapped */
+            vlog("vmm: allocating %d bytes of pages\n", (int)ioctl_param);
+            return vmm_alloc(f, PAGE_ALIGN((int)ioctl_param), PAGE_SIZE,
+                    f->nhandles ? VMM_MAX_EXTENTS : VMM_INT_EXTENTS);
+
+        case IOCTL_FREE:
+
+            vlog("vmm: freeing idx %d\n", (int)ioctl_param);
+            return vmm_release_page(f, (int)ioctl_param);
+
+        case IOCTL_REALLOC:
+        {
+            struct vmm_realloc r;
+
+            if (vcopy_from_user(&r, (struct vmm_realloc*)ioctl_param, sizeof(r)))
+                return -EFAULT;
+
+            vlog("vmm: resizing idx %lld to %d bytes\n", r.idx, r.size);
+            r.idx = vmm_resize(f, r.idx, r.size);
+            if (r.idx < 0) return r.idx;
+
+            if (vcopy_to_user((struct vmm_realloc*)ioctl_param, &r, sizeof(r)))
+                return -EFAULT;
+            return 0;
+        }
+
+        case IOCTL_ADD_EXTENT:
+
+            vlog("vmm: adding an extent of %d bytes\n", (int)ioctl_param);
+            return vmm_add_extent((int)ioctl_param);
+
+        case IOCTL_HANDLES:
+
+            vlog("vmm: using handles\n");
+            return vmm_use_handles(f);
+
+        case IOCTL_COMPACT:
+
+            vlog("vmm: compacting\n");
+            return vmm_compact();
+
+        case IOCTL_SET_IDX:
+
+            f->idx = (int)ioctl_param;
+            vlog("vmm: setting idx to %lld\n", f->idx);
+            return 0;
+
+        case IOCTL_SET_READ_SIZE:
+
+            f->read_size = (int)ioctl_param;
+            vlog("vmm: setting read size to %d\n", f->read_size);
+            return 0;
+
+        case IOCTL_WRITE:
+
+            /* the page could be changed by another thread sharing the file */
+            idx = vmm_lookup(f, f->idx);
+
+            /* get the page size */
+            size = vmm_size(idx);
+            if (size < 0) {
+                printb("vmm: writing out of allocated area\n");
+                return -1;
+            }
+
+            /* length of the string with its terminator, looking no further than fits */
+            bytes = vstrnlen_user((char*)ioctl_param, size + 1);
+            if (bytes == 0) return -EFAULT;
+
+            /* no terminator in sight means we would write outside the page */
+            if (bytes > size + 1) {
+                printb("vmm: writing out of allocated area\n");
+                return -1;
+            }
+            bytes--;
+
+            /* copy the whole string into the pool at once */
+            p = vmm_bounds(idx, 0, bytes);
+            if (!p) {
+                printb("vmm: writing out of allocated area\n");
+                return -1;
+            }
+            if (vcopy_from_user(p, (char*)ioctl_param, bytes))
+                bytes = -EFAULT;
+            else if (vmm_debug)
+                for (i = 0; i < bytes; i++)
+                    printb("wrote %c to %lld\n", p[i], idx+i);
+            vmm_drop(idx >> VMM_EXTENT_SHIFT);
+            if (bytes < 0) return bytes;
+
+            vlog("vmm: wrote %d bytes\n", bytes);
+
+            /* return how many bytes were written */
+            return bytes;
+
+        case IOCTL_READ:
+
+            idx = vmm_lookup(f, f->idx);
+            bytes = f->read_size;
+
+            /* return error if trying to read more than the page size */
+            p = vmm_bounds(idx, 0, bytes);
+            if (!p) {
+                printb("vmm: read bigger than allocated area\n");
+                return -1;
+            }
+
+            /* send the whole thing to the user at once */
+            if (vcopy_to_user((char*)ioctl_param, p, bytes))
+                bytes = -EFAULT;
+            else if (vmm_debug)
+                for (i = 0; i < bytes; i++)
+                    printb("read %c from %lld\n", p[i], idx+i);
+            vmm_drop(idx >> VMM_EXTENT_SHIFT);
+            if (bytes < 0) return bytes;
+
+            vlog("vmm: read %d bytes\n", bytes);
+
+            /* return how many bytes were read */
+            return bytes;
+
+        case IOCTL_PWRITE:
+        case IOCTL_PREAD:
+        {
+            struct vmm_rw rw;
+
+            if (vcopy_from_user(&rw, (struct vmm_rw*)ioctl_param, sizeof(rw)))
+                return -EFAULT;
+
+            return vmm_copy(vmm_lookup(f, rw.idx), rw.offset, rw.len, rw.buf, ioctl_num == IOCTL_PWRITE);
+        }
+
+        case IOCTL_FILL:
+        case IOCTL_COPY:
+        case IOCTL_COMPARE:
+        {
+            struct vmm_range r;
+
+            if (vcopy_from_user(&r, (struct vmm_range*)ioctl_param, sizeof(r)))
+                return -EFAULT;
+
+            vlog("vmm: %s %d bytes at idx %lld+%d\n", ioctl_num == IOCTL_FILL ? "filling" :
+                    ioctl_num == IOCTL_COPY ? "copying" : "comparing", r.len, r.idx, r.offset);
+            r.idx = vmm_lookup(f, r.idx);
+            r.src = vmm_lookup(f, r.src);
+            return vmm_range(ioctl_num, &r);
+        }
+
+        case IOCTL_BATCH:
+        {
+            struct vmm_batch batch;
+            struct vmm_op *ops;
+
+            if (vcopy_from_user(&batch, (struct vmm_batch*)ioctl_param, sizeof(batch)))
+                return -EFAULT;
+            if (batch.count < 0 || batch.count > VMM_BATCH_MAX)
+                return -EINVAL;
+            if (batch.count == 0)
+                return 0;
+
+            /* one copy in and one copy out for the whole batch */
+            ops = vmm_zalloc(batch.count * sizeof(*ops));
+            if (!ops) return -ENOMEM;
+            if (vcopy_from_user(ops, batch.ops, batch.count * sizeof(*ops))) {
+                vmm_free(ops);
+                return -EFAULT;
+            }
+
+            for (i = 0; i < batch.count; i++)
+                ops[i].result = vmm_run_op(f, &ops[i]);
+
+            if (vcopy_to_user(batch.ops, ops, batch.count * sizeof(*ops))) {
+                vmm_free(ops);
+                return -EFAULT;
+            }
+
+            vmm_free(ops);
+            return batch.count;
+        }
+
+        case IOCTL_STATS:
+        {
+            struct vmm_stats vs;
+
+            vmm_get_stats(&vs);
+            if (vcopy_to_user((struct vmm_stats*)ioctl_param, &vs, sizeof(vs)))
+                return -EFAULT;
+            return 0;
+        }
+
+        default: printb("vmm: unknown ioctl call\n");
+    }
+
+    return 0;
+}
+
+/* ioctl callback function, for the open file 'f' */
+long vmm_ioctl(struct vmm_file *f, unsigned int ioctl_num, unsigned long ioctl_param)
+{
+    long rt;
+
+    /* IOCTL_COMPACT takes every file's move_lock itself */
+    if (!f->nhandles || ioctl_num == IOCTL_COMPACT)
+        return vmm_do_ioctl(f, ioctl_num, ioctl_param);
+
+    /* the file's pages stay where they are until it is done with them */
+    block(&f->move_lock);
+    rt = vmm_do_ioctl(f, ioctl_num, ioctl_param);
+    bunlock(&f->move_lock);
+
+    return rt;
+}
+
+/*
+ * Whether 'len' bytes from 'idx' on may be mapped by 'f': 'idx' has to
+ * be a page 'f' owns and they have to fit in it, and 'f' can't be using
+ * handles since its pages could move out from under the mapping. The
+ * mapping is counted until vmm_unmap. Returns the start of the extent
+ * the page is in, held until vmm_map_done, with how far into it the
+ * page starts in 'offset', or NULL.
+ */
+char *vmm_map_ok(struct vmm_file *f, long long idx, long len, int *offset)
+{
+    buddy_t *b = NULL;
+
+    if (f->nhandles) return NULL;
+
+    block(&f->lock);
+    if (vmm_owns(f, idx) && (b = vmm_hold_idx(idx, offset)) != NULL &&
+            (buddy_pool_size(b, *offset) < len || vmm_count_map(f, idx) < 0)) {
+        vmm_drop(idx >> VMM_EXTENT_SHIFT);
+        b = NULL;
+    }
+    bunlock(&f->lock);
+
+    return b ? b->pool : NULL;
+}
+
+void vmm_map_done(long long idx)
+{
+    vmm_drop(idx >> VMM_EXTENT_SHIFT);
+}
+
+/*
+ * Count another mapping of a page that is already mapped, like when a
+ * process forks. It only bumps a count, so it can't fail.
+ */
+void vmm_map_again(struct vmm_file *f, long long idx)
+{
+    int i;
+
+    block(&f->lock);
+    i = vmm_mapped(f, idx);
+    if (i >= 0) f->maps[i].count++;
+    bunlock(&f->lock);
+}
+
+/* one mapping of page 'idx' is gone, once all are it can be freed again */
+void vmm_unmap(struct vmm_file *f, long long idx)
+{
+    int i;
+
+    block(&f->lock);
+    i = vmm_mapped(f, idx);
+    if (i >= 0 && --f->maps[i].count == 0)
+        f->maps[i] = f->maps[--f->nmaps];
+    bunlock(&f->lock);
+}
+
+/* whether 'p' points into any extent */
+int vmm_in_pool(const char *p)
+{
+    buddy_t *b;
+    int e, in;
+
+    for (e = 0; e < VMM_MAX_EXTENTS; e++) {
+        b = vmm_hold(e);
+        if (!b) continue;
+        in = p >= b->pool && p < b->pool + extent_bytes(b);
+        vmm_drop(e);
+        if (in) return 1;
+    }
+    return 0;
+}
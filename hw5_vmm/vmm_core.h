@@ -0,0 +1,128 @@
+#ifndef _VMM_CORE_H_
+#define _VMM_CORE_H_
+
+/*
+ * The part of the device that doesn't care whether it is in the kernel:
+ * every ioctl, checked against the pool and copied to and from the
+ * caller. vmm.c wraps it in a character device, vmm_shim.c in an
+ * LD_PRELOAD library that stands in for /dev/vmm in userspace. Like
+ * buddy.h the few things that differ are picked with NONKERNEL.
+ */
+#ifdef NONKERNEL
+#include <errno.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#define PAGE_SIZE 4096
+#define PAGE_ALIGN(x) (((x) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+#define vmm_zalloc(size) calloc(1, size)
+#define vmm_free(p) free(p)
+#define vcopy_from_user(to, from, n) (memcpy(to, from, n), 0)
+#define vcopy_to_user(to, from, n) (memcpy(to, from, n), 0)
+/* length with the terminator, more than 'n' if it isn't in the first 'n' bytes */
+#define vstrnlen_user(s, n) (strnlen(s, n) < (size_t)(n) ? (int)strnlen(s, n) + 1 : (n) + 1)
+#define vmm_relax() sched_yield()
+/* fully ordered, hold/drop and vmm_shrink rely on that */
+typedef long vatomic_t;
+#define vatomic_read(p) __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define vatomic_set(p, v) __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#define vatomic_add(p, n) __atomic_add_fetch(p, n, __ATOMIC_SEQ_CST)
+#define vatomic_cas(p, old, new) __sync_bool_compare_and_swap(p, old, new)
+#define vread_once(x) __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define vwrite_once(x, v) __atomic_store_n(&(x), v, __ATOMIC_SEQ_CST)
+#include <pthread.h>
+/* somewhere to sleep until a condition someone else makes true holds */
+typedef struct { pthread_mutex_t lock; pthread_cond_t cond; } vwait_t;
+#define vwait_init(w) do { pthread_mutex_init(&(w)->lock, NULL); pthread_cond_init(&(w)->cond, NULL); } while (0)
+#define vwait_event(w, c) do { \
+        pthread_mutex_lock(&(w)->lock); \
+        while (!(c)) pthread_cond_wait(&(w)->cond, &(w)->lock); \
+        pthread_mutex_unlock(&(w)->lock); \
+    } while (0)
+#define vwake(w) do { \
+        pthread_mutex_lock(&(w)->lock); \
+        pthread_cond_broadcast(&(w)->cond); \
+        pthread_mutex_unlock(&(w)->lock); \
+    } while (0)
+#else
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <asm/uaccess.h>
+#define vmm_zalloc(size) kzalloc(size, GFP_KERNEL)
+#define vmm_free(p) kfree(p)
+#define vcopy_from_user(to, from, n) copy_from_user(to, from, n)
+#define vcopy_to_user(to, from, n) copy_to_user(to, from, n)
+#define vstrnlen_user(s, n) strnlen_user(s, n)
+#define vmm_relax() cond_resched()
+#include <linux/atomic.h>
+typedef atomic_long_t vatomic_t;
+#define vatomic_read(p) ({ smp_mb(); atomic_long_read(p); })
+#define vatomic_set(p, v) atomic_long_set(p, v)
+#define vatomic_add(p, n) atomic_long_add_return(n, p)
+#define vatomic_cas(p, old, new) (atomic_long_cmpxchg(p, old, new) == (old))
+#define vread_once(x) ({ smp_mb(); READ_ONCE(x); })
+#define vwrite_once(x, v) smp_store_mb(x, v)
+#include <linux/wait.h>
+#define vwait_t wait_queue_head_t
+#define vwait_init(w) init_waitqueue_head(w)
+#define vwait_event(w, c) wait_event(*(w), c)
+#define vwake(w) wake_up_all(w)
+#endif
+
+#include "buddy.h"
+#include "vmm.h"
+
+/* log every operation and every byte read and written */
+extern int vmm_debug;
+
+/*
+ * What every open file of the device remembers for IOCTL_WRITE and
+ * IOCTL_READ, so processes don't pick each other's pages, and the pages
+ * allocated through it. Only the file that allocated a page can free or
+ * resize it, and whatever it still has is freed when it is closed, so a
+ * client that crashes doesn't leak its pages.
+ *
+ * A file using handles also has a table from its handles to where their
+ * pages are. Its ioctls run one at a time under 'move_lock', which
+ * IOCTL_COMPACT takes too before it moves any of the file's pages.
+ *
+ * The pages the file has mapped are counted in 'maps', a page can't be
+ * freed or resized until every mapping of it is gone.
+ */
+struct vmm_map {
+    long long idx;          /* a mapped page */
+    int count;              /* mappings of it */
+};
+
+struct vmm_file {
+    long long idx;          /* currently selected page */
+    int read_size;          /* how many bytes to read when read ioctl is called */
+    block_t lock;           /* guards the owned pages */
+    long long *owned;       /* open addressed table of owned pages, -1 for empty slots */
+    int nowned;             /* pages in it */
+    int slots;              /* size of the table, a power of 2 */
+    block_t move_lock;      /* keeps the pages where they are, only with handles */
+    long long *handles;     /* page of every handle, a free one has -2 - the next free one */
+    int nhandles;           /* size of the table, 0 if the file uses indexes */
+    int free_handle;        /* first free handle, -1 if none */
+    struct vmm_file *next;  /* next file using handles */
+    struct vmm_map *maps;   /* its mapped pages */
+    int nmaps;              /* pages in it */
+    int maps_cap;           /* room in it */
+};
+
+int vmm_init(int pool_size, int extent_size);
+int vmm_add_extent(int size);
+void vmm_exit(void);
+struct vmm_file *vmm_open(void);
+void vmm_release(struct vmm_file *f);
+long vmm_ioctl(struct vmm_file *f, unsigned int ioctl_num, unsigned long ioctl_param);
+char *vmm_map_ok(struct vmm_file *f, long long idx, long len, int *offset);
+void vmm_map_done(long long idx);
+void vmm_map_again(struct vmm_file *f, long long idx);
+void vmm_unmap(struct vmm_file *f, long long idx);
+int vmm_in_pool(const char *p);
+void vmm_get_stats(struct vmm_stats *vs);
+
+#endif
@@ -0,0 +1,272 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "vmm_core.h"
+
+/*
+ * Stands in for /dev/vmm in userspace, LD_PRELOAD it into any program
+ * that uses the device:
+ *
+ *      LD_PRELOAD=./libvmm.so ./vmm_test
+ *
+ * Opening /dev/vmm gets a real file descriptor (of /dev/null, so the
+ * number can't be handed out twice) and everything the program does
+ * with it goes to vmm_core.c instead of the kernel. The pool is made on
+ * the first open, VMM_POOL_SIZE, VMM_EXTENT_SIZE and VMM_DEBUG do what
+ * the module's pool_size, extent_size and debug parameters do.
+ */
+
+#define MAX_FDS 1024
+#define MAX_MAPS 1024
+
+/*
+ * An open /dev/vmm. Its fd, every mapping of its pages and every call
+ * still running on it hold a reference, it is released by the last one
+ * like the kernel releases a file on its last fput.
+ */
+struct shim_file {
+    struct vmm_file *f;
+    int refs;
+};
+
+/* a page mapped with mmap, munmap only gets the address back */
+struct shim_map {
+    char *addr;
+    struct shim_file *file; /* NULL if the slot is free */
+    long long idx;
+};
+
+static pthread_mutex_t shim_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct shim_file *files[MAX_FDS];    /* open file of every fd that is /dev/vmm */
+static struct shim_map maps[MAX_MAPS];      /* every live mapping, guarded by shim_lock too */
+static int initialized;
+
+static int (*real_open)(const char *path, int flags, ...);
+static int (*real_close)(int fd);
+static int (*real_ioctl)(int fd, unsigned long request, ...);
+static void *(*real_mmap)(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+static int (*real_munmap)(void *addr, size_t len);
+
+static void shim_init(void)
+{
+    char *env;
+
+    real_open = dlsym(RTLD_NEXT, "open");
+    real_close = dlsym(RTLD_NEXT, "close");
+    real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+    real_mmap = dlsym(RTLD_NEXT, "mmap");
+    real_munmap = dlsym(RTLD_NEXT, "munmap");
+
+    env = getenv("VMM_DEBUG");
+    vmm_debug = env ? atoi(env) : 0;
+}
+
+/* the open file behind 'fd' with a reference taken, NULL if it isn't /dev/vmm */
+static struct shim_file *shim_get(int fd)
+{
+    struct shim_file *file = NULL;
+
+    pthread_mutex_lock(&shim_lock);
+    if (fd >= 0 && fd < MAX_FDS && files[fd]) {
+        file = files[fd];
+        file->refs++;
+    }
+    pthread_mutex_unlock(&shim_lock);
+
+    return file;
+}
+
+static void shim_put(struct shim_file *file)
+{
+    int last;
+
+    pthread_mutex_lock(&shim_lock);
+    last = --file->refs == 0;
+    pthread_mutex_unlock(&shim_lock);
+
+    if (last) {
+        vmm_release(file->f);
+        free(file);
+    }
+}
+
+int open(const char *path, int flags, ...)
+{
+    struct shim_file *file;
+    char *env;
+    mode_t mode = 0;
+    va_list ap;
+    int fd, size;
+
+    if (!real_open) shim_init();
+
+    if (flags & O_CREAT) {
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+
+    if (strcmp(path, "/dev/" DEVICE_NAME))
+        return real_open(path, flags, mode);
+
+    pthread_mutex_lock(&shim_lock);
+
+    /* like loading the module */
+    if (!initialized) {
+        env = getenv("VMM_POOL_SIZE");
+        size = env ? atoi(env) : DEFAULT_POOL_SIZE;
+        env = getenv("VMM_EXTENT_SIZE");
+        if (vmm_init(size, env ? atoi(env) : DEFAULT_EXTENT_SIZE) < 0) {
+            pthread_mutex_unlock(&shim_lock);
+            errno = ENOMEM;
+            return -1;
+        }
+        initialized = 1;
+    }
+
+    fd = real_open("/dev/null", O_RDWR, 0);
+    if (fd >= 0 && fd >= MAX_FDS) {
+        real_close(fd);
+        fd = -1;
+        errno = EMFILE;
+    }
+
+    if (fd >= 0) {
+        file = malloc(sizeof(struct shim_file));
+        if (file) file->f = vmm_open();
+        if (file && file->f) {
+            file->refs = 1;
+            files[fd] = file;
+        } else {
+            free(file);
+            real_close(fd);
+            fd = -1;
+            errno = ENOMEM;
+        }
+    }
+
+    pthread_mutex_unlock(&shim_lock);
+    return fd;
+}
+
+int open64(const char *path, int flags, ...) __attribute__((alias("open")));
+
+int close(int fd)
+{
+    struct shim_file *file = NULL;
+
+    if (!real_close) shim_init();
+
+    pthread_mutex_lock(&shim_lock);
+    if (fd >= 0 && fd < MAX_FDS) {
+        file = files[fd];
+        files[fd] = NULL;
+    }
+    pthread_mutex_unlock(&shim_lock);
+
+    /* a call still running on it or a mapping keeps it open */
+    if (file) shim_put(file);
+    return real_close(fd);
+}
+
+/* errors come back as -1 and errno, like they would from the kernel */
+int ioctl(int fd, unsigned long request, ...)
+{
+    struct shim_file *file;
+    unsigned long param;
+    va_list ap;
+    long rt;
+
+    if (!real_ioctl) shim_init();
+
+    va_start(ap, request);
+    param = va_arg(ap, unsigned long);
+    va_end(ap);
+
+    file = shim_get(fd);
+    if (!file) return real_ioctl(fd, request, param);
+
+    rt = vmm_ioctl(file->f, request, param);
+    shim_put(file);
+    if (rt < 0) {
+        errno = rt == -1 ? EPERM : -rt;
+        return -1;
+    }
+
+    return rt;
+}
+
+/* the pool is already in our address space, so a mapping is a pointer into it */
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset)
+{
+    struct shim_file *file;
+    char *extent = NULL;
+    int off, i;
+
+    if (!real_mmap) shim_init();
+
+    file = shim_get(fd);
+    if (!file)
+        return real_mmap(addr, len, prot, flags, fd, offset);
+
+    pthread_mutex_lock(&shim_lock);
+
+    for (i = 0; i < MAX_MAPS && maps[i].file; i++)
+        ;
+
+    if (i < MAX_MAPS && !(offset & (PAGE_SIZE - 1)))
+        extent = vmm_map_ok(file->f, offset, PAGE_ALIGN(len), &off);
+
+    /* the mapping keeps the reference we took */
+    if (extent) {
+        /* nothing to set up, the extent is already in our address space */
+        vmm_map_done(offset);
+        maps[i].addr = extent + off;
+        maps[i].file = file;
+        maps[i].idx = offset;
+    }
+
+    pthread_mutex_unlock(&shim_lock);
+
+    if (!extent) {
+        shim_put(file);
+        errno = i < MAX_MAPS ? EINVAL : ENOMEM;
+        return MAP_FAILED;
+    }
+    return extent + off;
+}
+
+void *mmap64(void *addr, size_t len, int prot, int flags, int fd, off_t offset) __attribute__((alias("mmap")));
+
+int munmap(void *addr, size_t len)
+{
+    struct shim_file *file = NULL;
+    int i;
+
+    if (!real_munmap) shim_init();
+
+    if (!vmm_in_pool(addr))
+        return real_munmap(addr, len);
+
+    /* nothing to unmap for a pointer into the pool, just stop counting it */
+    pthread_mutex_lock(&shim_lock);
+    for (i = 0; i < MAX_MAPS; i++) {
+        if (maps[i].file && maps[i].addr == addr) {
+            file = maps[i].file;
+            maps[i].file = NULL;
+            vmm_unmap(file->f, maps[i].idx);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shim_lock);
+
+    if (file) shim_put(file);
+    return 0;
+}
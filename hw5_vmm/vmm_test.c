@@ -2,7 +2,9 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include "vmm.h"
 
 int get_mem(int fd, int bytes)
@@ -10,50 +12,94 @@ int get_mem(int fd, int bytes)
     return ioctl(fd, IOCTL_ALLOC, bytes);
 }
 
+int get_pages(int fd, int bytes)
+{
+    return ioctl(fd, IOCTL_ALLOC_PAGES, bytes);
+}
+
+/* map page 'idx' of 'bytes' bytes, NULL if it can't be */
+char *map_mem(int fd, int idx, int bytes)
+{
+    char *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, idx);
+    return p == MAP_FAILED ? NULL : p;
+}
+
 int free_mem(int fd, int idx)
 {
     return ioctl(fd, IOCTL_FREE, idx);
 }
 
-int write_mem(int fd, int idx, char *buf)
+int realloc_mem(int fd, int idx, int bytes)
 {
-    int rt = 0;
-
-    /* set the page we want to write to */
-    rt = ioctl(fd, IOCTL_SET_IDX, idx);
-    if (rt < 0) return rt;
+    struct vmm_realloc r = {idx, bytes};
+    return ioctl(fd, IOCTL_REALLOC, &r) < 0 ? -1 : r.idx;
+}
 
-    /* execute the write */
-    rt = ioctl(fd, IOCTL_WRITE, buf);
+int add_extent(int fd, int bytes)
+{
+    return ioctl(fd, IOCTL_ADD_EXTENT, bytes);
+}
 
-    return rt;
+/* write the string 'buf' to page 'idx', in one call */
+int write_mem(int fd, int idx, char *buf)
+{
+    struct vmm_rw rw = {idx, 0, strlen(buf), buf};
+    return ioctl(fd, IOCTL_PWRITE, &rw);
 }
 
+/* read 'size' bytes starting at 'idx', which can be inside a page */
 int read_mem(int fd, int idx, char *buf, int size)
 {
-    int rt = 0;
+    struct vmm_rw rw = {idx, 0, size, buf};
+    return ioctl(fd, IOCTL_PREAD, &rw);
+}
 
-    /* set the page we want to read from */
-    rt = ioctl(fd, IOCTL_SET_IDX, idx);
-    if (rt < 0) return rt;
+/* set 'size' bytes from 'idx' on to 'c' */
+int fill_mem(int fd, int idx, int c, int size)
+{
+    struct vmm_range r = {idx, 0, size, 0, 0, c};
+    return ioctl(fd, IOCTL_FILL, &r);
+}
 
-    /* set how many bytes we want to read */
-    rt = ioctl(fd, IOCTL_SET_READ_SIZE, size);
-    if (rt < 0) return rt;
+/* copy 'size' bytes from 'src' to 'idx' inside the pool */
+int copy_mem(int fd, int idx, int src, int size)
+{
+    struct vmm_range r = {idx, 0, size, src, 0, 0};
+    return ioctl(fd, IOCTL_COPY, &r);
+}
 
-    /* execute the read */
-    rt = ioctl(fd, IOCTL_READ, buf);
+/* how many of 'size' bytes at 'idx' and 'src' are the same before one isn't */
+int compare_mem(int fd, int idx, int src, int size)
+{
+    struct vmm_range r = {idx, 0, size, src, 0, 0};
+    return ioctl(fd, IOCTL_COMPARE, &r);
+}
 
-    return rt;
+/* have 'fd' hand out handles instead of indexes */
+int use_handles(int fd)
+{
+    return ioctl(fd, IOCTL_HANDLES);
 }
 
+/* move pages allocated through handles out of the way, returns how many moved */
+int compact(int fd)
+{
+    return ioctl(fd, IOCTL_COMPACT);
+}
+
+int get_stats(int fd, struct vmm_stats *st)
+{
+    return ioctl(fd, IOCTL_STATS, st);
+}
 
 int main(void)
 {
-    int mem, ref;
+    int mem, other, ref, h, moved;
     char buffer[4096];
+    char *map;
+    struct vmm_stats st;
 
-    mem = open("/dev/vmm", 0);
+    mem = open("/dev/vmm", O_RDWR);
     if (mem < 0) {
         printf("Can't open device file\n");
         exit(-1);
@@ -62,10 +108,73 @@ int main(void)
     ref = get_mem(mem, 100);
     sprintf(buffer, "Hello buddy");
     write_mem(mem, ref, buffer);
+    ref = realloc_mem(mem, ref, 1000);
     read_mem(mem, ref+3, buffer, 10);
     printf("buffer: %s\n", buffer);
+
+    if (get_stats(mem, &st) == 0)
+        printf("allocated: %lld of %lld bytes, largest free: %lld\n",
+                st.allocated, st.size, st.largest);
+    free_mem(mem, ref);
+
+    /* the same without any copying */
+    ref = get_pages(mem, 4096);
+    map = map_mem(mem, ref, 4096);
+    if (map) {
+        strcpy(map, "Hello mmap");
+        read_mem(mem, ref, buffer, 11);
+        printf("mapped: %s, free while mapped: %d\n", buffer, free_mem(mem, ref));
+        munmap(map, 4096);
+    }
     free_mem(mem, ref);
 
+    /* moving bytes around inside the pool without reading them out */
+    ref = get_mem(mem, 64);
+    other = get_mem(mem, 64);
+    fill_mem(mem, ref, '-', 64);
+    write_mem(mem, ref, "Hello pool");
+    copy_mem(mem, other, ref, 64);
+    fill_mem(mem, other+6, 'P', 1);
+    read_mem(mem, other, buffer, 12);
+    buffer[12] = '\0';
+    printf("copied: %s, same for %d bytes\n", buffer, compare_mem(mem, other, ref, 64));
+    free_mem(mem, other);
+    free_mem(mem, ref);
+
+    /* pages belong to the file they were allocated through */
+    other = open("/dev/vmm", O_RDWR);
+    if (other >= 0) {
+        get_mem(other, 100);
+        ref = get_mem(other, 5000);
+        printf("free from another file: %d\n", free_mem(mem, ref));
+        ref = get_pages(other, 4096);
+        printf("map from another file: %s\n", map_mem(mem, ref, 4096) ? "mapped" : "refused");
+        close(other);
+        if (get_stats(mem, &st) == 0)
+            printf("allocated after close: %lld bytes\n", st.allocated);
+    }
+
+    /* the pool grows when something doesn't fit and shrinks back after */
+    ref = get_mem(mem, 4 << 20);
+    if (get_stats(mem, &st) == 0)
+        printf("grown: page at %d, pool is %lld bytes\n", ref, st.size);
+    free_mem(mem, ref);
+    if (get_stats(mem, &st) == 0)
+        printf("shrunk: pool is %lld bytes\n", st.size);
+
+    /* pages behind handles can be moved to make room, the handle stays the same */
+    other = open("/dev/vmm", O_RDWR);
+    if (other >= 0 && use_handles(other) == 0) {
+        ref = get_mem(other, 4096);
+        h = get_mem(other, 4096);
+        write_mem(other, h, "Hello handle");
+        free_mem(other, ref);
+        moved = compact(other);
+        read_mem(other, h, buffer, 13);
+        printf("compacted: moved %d, handle %d still reads %s\n", moved, h, buffer);
+        close(other);
+    }
+
     return 0;
 }
 